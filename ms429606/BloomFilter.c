@@ -0,0 +1,107 @@
+/* Author Mikołaj Szkaradek */
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "BloomFilter.h"
+
+#define BLOCK_WORDS 8 // 512 bits, one cache line.
+#define BLOCK_BITS (BLOCK_WORDS * 64)
+#define BITS_PER_KEY 10 // With 7 bits set per key gives about 1% false positives.
+#define BITS_SET 7
+
+struct BloomFilter {
+    SharedArena* arena; // Source of the memory of the filter.
+    size_t mask; // Number of blocks - 1, the number of blocks is a power of two.
+    size_t capacity; // Number of keys the filter was sized for.
+    atomic_size_t keys; // Keys added so far, valid or not.
+    atomic_size_t forgotten; // Keys that are no longer valid.
+    _Atomic uint64_t* words; // Aligned to a cache line, inside the same allocation.
+};
+
+uint64_t bloom_hash(uint64_t hash, const char* data, size_t len)
+{
+    // FNV-1a, which can be continued from any prefix.
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// Finalizer of splitmix64, FNV alone leaves the low bits poorly mixed.
+static uint64_t mix(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    x ^= x >> 31;
+    return x;
+}
+
+BloomFilter* bloom_new_in(SharedArena* arena, size_t expected)
+{
+    size_t blocks = 1;
+    while (blocks * BLOCK_BITS < expected * BITS_PER_KEY)
+        blocks <<= 1;
+    size_t bytes = blocks * BLOCK_WORDS * sizeof(uint64_t);
+    BloomFilter* filter = arena_alloc(arena, sizeof(BloomFilter) + bytes + 63);
+    if (!filter)
+        return NULL;
+    filter->arena = arena;
+    filter->mask = blocks - 1;
+    filter->capacity = blocks * BLOCK_BITS / BITS_PER_KEY;
+    atomic_init(&filter->keys, 0);
+    atomic_init(&filter->forgotten, 0);
+    uintptr_t words = ((uintptr_t)(filter + 1) + 63) & ~(uintptr_t)63;
+    filter->words = (_Atomic uint64_t*)words;
+    for (size_t i = 0; i < blocks * BLOCK_WORDS; ++i)
+        atomic_init(&filter->words[i], 0);
+    return filter;
+}
+
+void bloom_free(BloomFilter* filter)
+{
+    arena_free(filter->arena, filter);
+}
+
+void bloom_add(BloomFilter* filter, uint64_t hash)
+{
+    uint64_t h = mix(hash);
+    _Atomic uint64_t* block = filter->words + (h & filter->mask) * BLOCK_WORDS;
+    uint64_t bits = mix(h);
+    // Each of the 7 bits is chosen by 9 bits of the second hash.
+    for (int i = 0; i < BITS_SET; ++i, bits >>= 9) {
+        unsigned bit = bits & (BLOCK_BITS - 1);
+        atomic_fetch_or_explicit(&block[bit / 64], 1ull << (bit % 64), memory_order_relaxed);
+    }
+    atomic_fetch_add_explicit(&filter->keys, 1, memory_order_relaxed);
+}
+
+bool bloom_may_contain(BloomFilter* filter, uint64_t hash)
+{
+    uint64_t h = mix(hash);
+    _Atomic uint64_t* block = filter->words + (h & filter->mask) * BLOCK_WORDS;
+    uint64_t bits = mix(h);
+    for (int i = 0; i < BITS_SET; ++i, bits >>= 9) {
+        unsigned bit = bits & (BLOCK_BITS - 1);
+        if (!(atomic_load_explicit(&block[bit / 64], memory_order_relaxed)
+              & (1ull << (bit % 64))))
+            return false;
+    }
+    return true;
+}
+
+void bloom_forget(BloomFilter* filter, size_t count)
+{
+    atomic_fetch_add_explicit(&filter->forgotten, count, memory_order_relaxed);
+}
+
+bool bloom_overdue(BloomFilter* filter)
+{
+    // Rebuilding when half of the capacity is forgotten keeps the cost
+    // of rebuilding within a constant per add or forget.
+    return atomic_load_explicit(&filter->keys, memory_order_relaxed) > filter->capacity
+        || atomic_load_explicit(&filter->forgotten, memory_order_relaxed) > filter->capacity / 2;
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "SharedArena.h"
+
+// An approximate set of keys given by their 64-bit hashes.
+// A key that was added is always reported as present, a key that was
+// not is reported as present with a probability of about 1% as long
+// as the filter holds no more keys than it was created for.
+// Keys cannot be removed, the filter only counts how many of its keys
+// are no longer valid, so the owner knows when to build a new one.
+// Bits are split into blocks of one cache line and all bits of a key
+// lie in one block, so each operation touches a single cache line.
+// Any operations can run concurrently.
+typedef struct BloomFilter BloomFilter;
+
+// Hash of an empty key, the start for bloom_hash.
+#define BLOOM_HASH_START 14695981039346656037ull
+
+// Return the hash of a key extended with `len` bytes of `data`.
+// Hashing a key in parts gives the same result as hashing it at once.
+uint64_t bloom_hash(uint64_t hash, const char* data, size_t len);
+
+// Create a new, empty filter sized for `expected` keys, whose memory
+// comes from `arena` (from malloc if it is NULL).
+// Returns NULL if the arena is full.
+BloomFilter* bloom_new_in(SharedArena* arena, size_t expected);
+
+// Free the filter.
+void bloom_free(BloomFilter* filter);
+
+// Add the key with the given hash.
+void bloom_add(BloomFilter* filter, uint64_t hash);
+
+// Return false if the key with the given hash was surely never added.
+bool bloom_may_contain(BloomFilter* filter, uint64_t hash);
+
+// Note that `count` of the added keys are no longer valid.
+void bloom_forget(BloomFilter* filter, size_t count);
+
+// Return whether the filter should be built again, because it holds more
+// keys than it was sized for or most of its keys are no longer valid.
+bool bloom_overdue(BloomFilter* filter);
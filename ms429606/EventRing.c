@@ -0,0 +1,89 @@
+/* Author Mikołaj Szkaradek */
+#include "EventRing.h"
+#include "err.h"
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Each slot carries a sequence number telling whose turn it is.
+// A slot at position pos is free for a producer when seq == pos
+// and holds an item for the consumer when seq == pos + 1.
+typedef struct Slot {
+    atomic_size_t seq;
+    void* item;
+} Slot;
+
+struct EventRing {
+    size_t mask; // Capacity - 1, capacity is a power of two.
+    atomic_size_t tail; // Next position to push to, shared by producers.
+    size_t head; // Next position to pop from, owned by the consumer.
+    atomic_bool overflow;
+    Slot slots[];
+};
+
+EventRing* ring_new(size_t capacity)
+{
+    size_t size = 1;
+    while (size < capacity)
+        size <<= 1;
+    EventRing* ring = malloc(sizeof(EventRing) + size * sizeof(Slot));
+    CHECK_PTR(ring);
+    ring->mask = size - 1;
+    atomic_init(&ring->tail, 0);
+    ring->head = 0;
+    atomic_init(&ring->overflow, false);
+    for (size_t i = 0; i < size; ++i) {
+        atomic_init(&ring->slots[i].seq, i);
+        ring->slots[i].item = NULL;
+    }
+    return ring;
+}
+
+void ring_free(EventRing* ring)
+{
+    free(ring);
+}
+
+bool ring_push(EventRing* ring, void* item)
+{
+    if (!item)
+        return false;
+    size_t pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    while (true) {
+        Slot* slot = &ring->slots[pos & ring->mask];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        ptrdiff_t diff = (ptrdiff_t)seq - (ptrdiff_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->tail, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed)) {
+                slot->item = item;
+                atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) { // The consumer has not freed this slot yet.
+            atomic_store_explicit(&ring->overflow, true, memory_order_relaxed);
+            return false;
+        } else {
+            pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        }
+    }
+}
+
+void* ring_pop(EventRing* ring)
+{
+    Slot* slot = &ring->slots[ring->head & ring->mask];
+    size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    if (seq != ring->head + 1)
+        return NULL;
+    void* item = slot->item;
+    slot->item = NULL;
+    atomic_store_explicit(&slot->seq, ring->head + ring->mask + 1, memory_order_release);
+    ring->head++;
+    return item;
+}
+
+bool ring_overflowed(EventRing* ring)
+{
+    return atomic_exchange_explicit(&ring->overflow, false, memory_order_relaxed);
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include <stdbool.h>
+#include <sys/types.h>
+
+// A bounded, lock-free ring buffer of pointers.
+// Any number of threads may push concurrently, but only one thread
+// at a time may pop (multi-producer, single-consumer).
+// Pushing into a full ring drops the item and raises the overflow flag.
+typedef struct EventRing EventRing;
+
+// Create a new, empty ring able to hold `capacity` items.
+// `capacity` is rounded up to a power of two.
+EventRing* ring_new(size_t capacity);
+
+// Free the ring. Items still stored in the ring are not free'd.
+void ring_free(EventRing* ring);
+
+// Append `item` and return true, or return false and set the overflow
+// flag if the ring is full. `item` must not be NULL.
+bool ring_push(EventRing* ring, void* item);
+
+// Remove and return the oldest item, or NULL if the ring is empty.
+void* ring_pop(EventRing* ring);
+
+// Return whether some push failed since the last call, and clear the flag.
+bool ring_overflowed(EventRing* ring);
@@ -18,16 +18,23 @@ struct Pair {
 struct HashMap {
     Pair* buckets[N_BUCKETS]; // Linked lists of key-value pairs.
     size_t size; // total number of entries in map.
+    SharedArena* arena; // Source of all memory of the map.
 };
 
 static unsigned int get_hash(const char* key);
 
 HashMap* hmap_new()
 {
-    HashMap* map = malloc(sizeof(HashMap));
+    return hmap_new_in(NULL);
+}
+
+HashMap* hmap_new_in(SharedArena* arena)
+{
+    HashMap* map = arena_alloc(arena, sizeof(HashMap));
     if (!map)
         return NULL;
     memset(map, 0, sizeof(HashMap));
+    map->arena = arena;
     return map;
 }
 
@@ -37,11 +44,11 @@ void hmap_free(HashMap* map)
         for (Pair* p = map->buckets[h]; p;) {
             Pair* q = p;
             p = p->next;
-            free(q->key);
-            free(q);
+            arena_free(map->arena, q->key);
+            arena_free(map->arena, q);
         }
     }
-    free(map);
+    arena_free(map->arena, map);
 }
 
 static Pair* hmap_find(HashMap* map, int h, const char* key)
@@ -71,8 +78,16 @@ bool hmap_insert(HashMap* map, const char* key, void* value)
     Pair* p = hmap_find(map, h, key);
     if (p)
         return false; // Already exists.
-    Pair* new_p = malloc(sizeof(Pair));
-    new_p->key = strdup(key);
+    Pair* new_p = arena_alloc(map->arena, sizeof(Pair));
+    size_t key_size = strlen(key) + 1;
+    char* new_key = arena_alloc(map->arena, key_size);
+    if (!new_p || !new_key) {
+        arena_free(map->arena, new_p);
+        arena_free(map->arena, new_key);
+        return false;
+    }
+    new_p->key = new_key;
+    memcpy(new_p->key, key, key_size);
     new_p->value = value;
     new_p->next = map->buckets[h];
     map->buckets[h] = new_p;
@@ -88,8 +103,8 @@ bool hmap_remove(HashMap* map, const char* key)
         Pair* p = *pp;
         if (strcmp(key, p->key) == 0) {
             *pp = p->next;
-            free(p->key);
-            free(p);
+            arena_free(map->arena, p->key);
+            arena_free(map->arena, p);
             map->size--;
             return true;
         }
@@ -2,6 +2,8 @@
 #include <stdbool.h>
 #include <sys/types.h>
 
+#include "SharedArena.h"
+
 // A structure representing a mapping from keys to values.
 // Keys are C-strings (null-terminated char*), all distinct.
 // Values are non-null pointers (void*, which you can cast to any other pointer type).
@@ -10,6 +12,11 @@ typedef struct HashMap HashMap;
 // Create a new, empty map.
 HashMap* hmap_new();
 
+// Create a new, empty map whose memory, including copies of keys,
+// comes from `arena` (from malloc if it is NULL).
+// Returns NULL if the arena is full.
+HashMap* hmap_new_in(SharedArena* arena);
+
 // Clear the map and free its memory. This frees the map and the keys
 // copied by hmap_insert, but does not free any values.
 void hmap_free(HashMap* map);
@@ -18,7 +25,8 @@ void hmap_free(HashMap* map);
 void* hmap_get(HashMap* map, const char* key);
 
 // Insert a `value` under `key` and return true,
-// or do nothing and return false if `key` already exists in the map.
+// or do nothing and return false if `key` already exists in the map
+// or the arena of the map is full.
 // `value` must not be NULL.
 // (The caller can free `key` at any time - the map internally uses a copy of it).
 bool hmap_insert(HashMap* map, const char* key, void* value);
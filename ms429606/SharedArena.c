@@ -0,0 +1,170 @@
+/* Author Mikołaj Szkaradek */
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "SharedArena.h"
+#include "err.h"
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0 // Older systems, the address is checked by hand.
+#endif
+
+#define ARENA_MAGIC "TREEARN1"
+
+// Where new arenas are mapped if possible. Far from the heap, the stack
+// and the usual mmap area, so other processes are likely to have it free.
+#define ARENA_ADDRESS_HINT ((void*)0x600000000000)
+
+// Blocks of class c take 16 << c bytes, including the block header.
+#define ARENA_CLASSES 28
+#define BLOCK_HEADER 16
+
+// Part of the arena needed to map it, read before mapping.
+typedef struct ArenaHeader {
+    char magic[8];
+    void* base; // Address of the mapping in every process.
+    size_t size; // Size of the whole segment.
+} ArenaHeader;
+
+typedef struct FreeList {
+    pthread_mutex_t lock;
+    void* head; // First free block, each one points to the next.
+} FreeList;
+
+// Placed at the start of the segment, blocks follow it.
+struct SharedArena {
+    ArenaHeader header;
+    atomic_size_t used; // Offset of the first byte never given out.
+    _Atomic(void*) root;
+    FreeList classes[ARENA_CLASSES];
+};
+
+static size_t first_block_offset()
+{
+    return (sizeof(SharedArena) + BLOCK_HEADER - 1) / BLOCK_HEADER * BLOCK_HEADER;
+}
+
+SharedArena* arena_create(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        return NULL;
+    size_t size = st.st_size;
+    if (size < first_block_offset()) {
+        errno = EINVAL;
+        return NULL;
+    }
+    SharedArena* arena = mmap(ARENA_ADDRESS_HINT, size, PROT_READ | PROT_WRITE,
+                              MAP_SHARED, fd, 0);
+    if (arena == MAP_FAILED)
+        return NULL;
+
+    arena->header.base = arena;
+    arena->header.size = size;
+    atomic_init(&arena->used, first_block_offset());
+    atomic_init(&arena->root, NULL);
+    pthread_mutexattr_t attr;
+    CHECK(pthread_mutexattr_init(&attr));
+    CHECK(pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED));
+    for (int c = 0; c < ARENA_CLASSES; ++c) {
+        CHECK(pthread_mutex_init(&arena->classes[c].lock, &attr));
+        arena->classes[c].head = NULL;
+    }
+    CHECK(pthread_mutexattr_destroy(&attr));
+    // Magic goes last, so no one attaches to a half formatted arena.
+    atomic_thread_fence(memory_order_release);
+    memcpy(arena->header.magic, ARENA_MAGIC, sizeof(arena->header.magic));
+    return arena;
+}
+
+SharedArena* arena_attach(int fd)
+{
+    ArenaHeader header;
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header)
+        || memcmp(header.magic, ARENA_MAGIC, sizeof(header.magic)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    SharedArena* arena = mmap(header.base, header.size, PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+    if (arena == MAP_FAILED)
+        return NULL;
+    if (arena != header.base) {
+        munmap(arena, header.size);
+        errno = EEXIST;
+        return NULL;
+    }
+    return arena;
+}
+
+void arena_detach(SharedArena* arena)
+{
+    munmap(arena, arena->header.size);
+}
+
+void* arena_alloc(SharedArena* arena, size_t size)
+{
+    if (!arena)
+        return malloc(size);
+
+    // Class 0 has no room for the free list link, so even empty
+    // requests take a block of class 1.
+    int c = 1;
+    while (c < ARENA_CLASSES && ((size_t)BLOCK_HEADER << c) - BLOCK_HEADER < size)
+        ++c;
+    if (c == ARENA_CLASSES)
+        return NULL;
+
+    FreeList* list = &arena->classes[c];
+    CHECK(pthread_mutex_lock(&list->lock));
+    char* block = list->head;
+    if (block)
+        list->head = *(void**)(block + BLOCK_HEADER);
+    CHECK(pthread_mutex_unlock(&list->lock));
+
+    if (!block) {
+        size_t block_size = (size_t)BLOCK_HEADER << c;
+        size_t offset = atomic_load(&arena->used);
+        do {
+            if (block_size > arena->header.size - offset)
+                return NULL;
+        } while (!atomic_compare_exchange_weak(&arena->used, &offset, offset + block_size));
+        block = (char*)arena + offset;
+        *(size_t*)block = c;
+    }
+    return block + BLOCK_HEADER;
+}
+
+void arena_free(SharedArena* arena, void* ptr)
+{
+    if (!arena) {
+        free(ptr);
+        return;
+    }
+    if (!ptr)
+        return;
+
+    char* block = (char*)ptr - BLOCK_HEADER;
+    FreeList* list = &arena->classes[*(size_t*)block];
+    CHECK(pthread_mutex_lock(&list->lock));
+    *(void**)ptr = list->head;
+    list->head = block;
+    CHECK(pthread_mutex_unlock(&list->lock));
+}
+
+void* arena_root(SharedArena* arena)
+{
+    return atomic_load(&arena->root);
+}
+
+void arena_set_root(SharedArena* arena, void* root)
+{
+    atomic_store(&arena->root, root);
+}
@@ -0,0 +1,38 @@
+#pragma once
+#include <sys/types.h>
+
+// A memory allocator working inside a shared memory segment, so that
+// structures built in it can be used by several processes at once.
+// The segment is mapped at the same address in every process, so plain
+// pointers into it stay valid everywhere and code using the arena does
+// not need any offset-based pointers.
+// Blocks are taken from per-size-class free lists, each guarded by
+// a process-shared mutex, or cut from the unused end of the segment.
+// Freed blocks are reused only for allocations of the same size class.
+typedef struct SharedArena SharedArena;
+
+// Format the segment behind `fd` (a memfd, shm_open or file descriptor,
+// already truncated to the wanted size) as an empty arena and map it.
+// Returns NULL and sets errno if the segment cannot be mapped or is too small.
+SharedArena* arena_create(int fd);
+
+// Map an arena formatted by arena_create in any process.
+// Returns NULL and sets errno if `fd` does not hold an arena, or EEXIST
+// if its address is already taken in this process.
+SharedArena* arena_attach(int fd);
+
+// Unmap the arena from this process. Its contents stay in the segment.
+void arena_detach(SharedArena* arena);
+
+// Allocate `size` bytes, aligned like malloc, from the arena.
+// If `arena` is NULL, the memory comes from malloc.
+// Returns NULL if the arena has no room for `size` bytes, the arena
+// is then left as it was.
+void* arena_alloc(SharedArena* arena, size_t size);
+
+// Free memory returned by arena_alloc with the same `arena`.
+void arena_free(SharedArena* arena, void* ptr);
+
+// Get or set the pointer every process uses as the entry to the arena.
+void* arena_root(SharedArena* arena);
+void arena_set_root(SharedArena* arena, void* root);
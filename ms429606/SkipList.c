@@ -0,0 +1,173 @@
+/* Author Mikołaj Szkaradek */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "SkipList.h"
+
+// Enough levels for far more keys than a folder can hold in practice.
+#define MAX_LEVEL 24
+
+typedef struct Node Node;
+
+struct Node {
+    char* key; // Stored right after the array of next pointers.
+    int level;
+    Node* next[]; // Successors on levels 0 .. level - 1.
+};
+
+struct SkipList {
+    Node* head; // Sentinel without key, of height MAX_LEVEL.
+    int level; // Highest level currently in use.
+    size_t size;
+    uint32_t seed; // State of the level generator.
+    SharedArena* arena; // Source of all memory of the list.
+};
+
+// Draw a level from the geometric distribution with p = 1/4.
+static int random_level(SkipList* list)
+{
+    // xorshift32, the list is never modified concurrently.
+    uint32_t x = list->seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    list->seed = x;
+
+    int level = 1;
+    while (level < MAX_LEVEL && (x & 3) == 0) {
+        level++;
+        x >>= 2;
+    }
+    return level;
+}
+
+static Node* node_new(SharedArena* arena, const char* key, int level)
+{
+    size_t key_size = key ? strlen(key) + 1 : 0;
+    Node* node = arena_alloc(arena, sizeof(Node) + level * sizeof(Node*) + key_size);
+    if (!node)
+        return NULL;
+    node->level = level;
+    node->key = NULL;
+    if (key) {
+        node->key = (char*)(node->next + level);
+        memcpy(node->key, key, key_size);
+    }
+    for (int i = 0; i < level; ++i)
+        node->next[i] = NULL;
+    return node;
+}
+
+SkipList* slist_new()
+{
+    return slist_new_in(NULL);
+}
+
+SkipList* slist_new_in(SharedArena* arena)
+{
+    SkipList* list = arena_alloc(arena, sizeof(SkipList));
+    if (!list)
+        return NULL;
+    list->arena = arena;
+    list->head = node_new(arena, NULL, MAX_LEVEL);
+    if (!list->head) {
+        arena_free(arena, list);
+        return NULL;
+    }
+    list->level = 1;
+    list->size = 0;
+    list->seed = (uint32_t)(uintptr_t)list | 1;
+    return list;
+}
+
+void slist_free(SkipList* list)
+{
+    for (Node* p = list->head; p;) {
+        Node* q = p;
+        p = p->next[0];
+        arena_free(list->arena, q);
+    }
+    arena_free(list->arena, list);
+}
+
+// Fill `update` with the last node before `key` on every level
+// and return the node at level 0 that follows it.
+static Node* find_predecessors(SkipList* list, const char* key, Node** update)
+{
+    Node* p = list->head;
+    for (int i = list->level - 1; i >= 0; --i) {
+        while (p->next[i] && strcmp(p->next[i]->key, key) < 0)
+            p = p->next[i];
+        if (update)
+            update[i] = p;
+    }
+    return p->next[0];
+}
+
+bool slist_insert(SkipList* list, const char* key)
+{
+    Node* update[MAX_LEVEL];
+    Node* found = find_predecessors(list, key, update);
+    if (found && strcmp(found->key, key) == 0)
+        return false; // Already exists.
+
+    int level = random_level(list);
+    Node* node = node_new(list->arena, key, level);
+    if (!node)
+        return false;
+    for (int i = list->level; i < level; ++i)
+        update[i] = list->head;
+    if (level > list->level)
+        list->level = level;
+
+    for (int i = 0; i < level; ++i) {
+        node->next[i] = update[i]->next[i];
+        update[i]->next[i] = node;
+    }
+    list->size++;
+    return true;
+}
+
+bool slist_remove(SkipList* list, const char* key)
+{
+    Node* update[MAX_LEVEL];
+    Node* found = find_predecessors(list, key, update);
+    if (!found || strcmp(found->key, key) != 0)
+        return false;
+
+    for (int i = 0; i < found->level; ++i)
+        update[i]->next[i] = found->next[i];
+    while (list->level > 1 && !list->head->next[list->level - 1])
+        list->level--;
+    arena_free(list->arena, found);
+    list->size--;
+    return true;
+}
+
+size_t slist_size(SkipList* list)
+{
+    return list->size;
+}
+
+SkipListIterator slist_iterator_after(SkipList* list, const char* after)
+{
+    SkipListIterator it = { list->head->next[0] };
+    if (after) {
+        Node* p = find_predecessors(list, after, NULL);
+        if (p && strcmp(p->key, after) == 0)
+            p = p->next[0];
+        it.node = p;
+    }
+    return it;
+}
+
+bool slist_next(SkipListIterator* it, const char** key)
+{
+    Node* p = it->node;
+    if (!p)
+        return false;
+    *key = p->key;
+    it->node = p->next[0];
+    return true;
+}
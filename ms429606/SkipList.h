@@ -0,0 +1,52 @@
+#pragma once
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "SharedArena.h"
+
+// A structure representing a lexicographically ordered set of keys.
+// Keys are C-strings (null-terminated char*), all distinct.
+// Lookups, inserts and removes take expected O(log n) time, iterating
+// from any position takes O(1) per key.
+// Like HashMap, the set is not synchronized: the caller must not modify
+// it concurrently with any other operation.
+typedef struct SkipList SkipList;
+
+// Create a new, empty set.
+SkipList* slist_new();
+
+// Create a new, empty set whose memory comes from `arena`
+// (from malloc if it is NULL). Returns NULL if the arena is full.
+SkipList* slist_new_in(SharedArena* arena);
+
+// Clear the set and free its memory, including keys copied by slist_insert.
+void slist_free(SkipList* list);
+
+// Insert a copy of `key` and return true,
+// or do nothing and return false if `key` already exists in the set
+// or the arena of the set is full.
+bool slist_insert(SkipList* list, const char* key);
+
+// Remove `key` and return true, or do nothing and return false
+// if `key` was not present.
+bool slist_remove(SkipList* list, const char* key);
+
+// Return the number of keys in the set.
+size_t slist_size(SkipList* list);
+
+typedef struct SkipListIterator SkipListIterator;
+
+// Return an iterator to the first key strictly greater than `after`,
+// or to the first key of the set if `after` is NULL. See `slist_next`.
+SkipListIterator slist_iterator_after(SkipList* list, const char* after);
+
+// Set `*key` to the key pointed by iterator and move the iterator
+// to the next key in order.
+// If there are no more keys, leaves `*key` unchanged and returns false.
+//
+// The set cannot be modified between calls to `slist_iterator_after` and `slist_next`.
+bool slist_next(SkipListIterator* it, const char** key);
+
+struct SkipListIterator {
+    void* node;
+};
@@ -0,0 +1,178 @@
+/* Author Mikołaj Szkaradek */
+#define _GNU_SOURCE // pthread_rwlockattr_setkind_np
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "HashMap.h"
+#include "StripedMap.h"
+#include "err.h"
+
+typedef struct Stripe {
+    pthread_rwlock_t lock; // Shared for lookups and iteration.
+    HashMap* map; // NULL until the first insert, like names.
+    SkipList* names;
+} Stripe;
+
+struct StripedMap {
+    atomic_size_t size;
+    SharedArena* arena; // Source of all memory of the map.
+    Stripe stripes[SMAP_STRIPES];
+};
+
+// FNV-1a, unrelated to the hash HashMap uses for its buckets,
+// so keys of one stripe still spread over all buckets.
+static unsigned int get_stripe(const char* key)
+{
+    uint32_t hash = 2166136261u;
+    while (*key) {
+        hash ^= (unsigned char)*key;
+        hash *= 16777619u;
+        ++key;
+    }
+    return hash % SMAP_STRIPES;
+}
+
+StripedMap* smap_new()
+{
+    return smap_new_in(NULL);
+}
+
+StripedMap* smap_new_in(SharedArena* arena)
+{
+    StripedMap* map = arena_alloc(arena, sizeof(StripedMap));
+    if (!map)
+        return NULL;
+    atomic_init(&map->size, 0);
+    map->arena = arena;
+    pthread_rwlockattr_t attr;
+    CHECK(pthread_rwlockattr_init(&attr));
+#ifdef __GLIBC__
+    // Readers are preferred by default, listings could then starve inserts.
+    CHECK(pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP));
+#endif
+    if (arena)
+        CHECK(pthread_rwlockattr_setpshared(&attr, PTHREAD_PROCESS_SHARED));
+    for (int s = 0; s < SMAP_STRIPES; ++s) {
+        CHECK(pthread_rwlock_init(&map->stripes[s].lock, &attr));
+        map->stripes[s].map = NULL;
+        map->stripes[s].names = NULL;
+    }
+    CHECK(pthread_rwlockattr_destroy(&attr));
+    return map;
+}
+
+void smap_free(StripedMap* map)
+{
+    for (int s = 0; s < SMAP_STRIPES; ++s) {
+        Stripe* stripe = &map->stripes[s];
+        if (stripe->map) {
+            hmap_free(stripe->map);
+            slist_free(stripe->names);
+        }
+        CHECK(pthread_rwlock_destroy(&stripe->lock));
+    }
+    arena_free(map->arena, map);
+}
+
+void* smap_get(StripedMap* map, const char* key)
+{
+    Stripe* stripe = &map->stripes[get_stripe(key)];
+    CHECK(pthread_rwlock_rdlock(&stripe->lock));
+    void* value = stripe->map ? hmap_get(stripe->map, key) : NULL;
+    CHECK(pthread_rwlock_unlock(&stripe->lock));
+    return value;
+}
+
+bool smap_insert(StripedMap* map, const char* key, void* value)
+{
+    if (!value)
+        return false;
+    Stripe* stripe = &map->stripes[get_stripe(key)];
+    CHECK(pthread_rwlock_wrlock(&stripe->lock));
+    if (!stripe->map) {
+        HashMap* values = hmap_new_in(map->arena);
+        SkipList* names = slist_new_in(map->arena);
+        if (!values || !names) {
+            if (values)
+                hmap_free(values);
+            if (names)
+                slist_free(names);
+            CHECK(pthread_rwlock_unlock(&stripe->lock));
+            return false;
+        }
+        stripe->map = values;
+        stripe->names = names;
+    }
+    bool inserted = hmap_insert(stripe->map, key, value);
+    if (inserted && !slist_insert(stripe->names, key)) {
+        hmap_remove(stripe->map, key); // The arena is full.
+        inserted = false;
+    }
+    if (inserted)
+        atomic_fetch_add_explicit(&map->size, 1, memory_order_relaxed);
+    CHECK(pthread_rwlock_unlock(&stripe->lock));
+    return inserted;
+}
+
+bool smap_remove(StripedMap* map, const char* key)
+{
+    Stripe* stripe = &map->stripes[get_stripe(key)];
+    CHECK(pthread_rwlock_wrlock(&stripe->lock));
+    bool removed = stripe->map && hmap_remove(stripe->map, key);
+    if (removed) {
+        slist_remove(stripe->names, key);
+        atomic_fetch_sub_explicit(&map->size, 1, memory_order_relaxed);
+    }
+    CHECK(pthread_rwlock_unlock(&stripe->lock));
+    return removed;
+}
+
+size_t smap_size(StripedMap* map)
+{
+    return atomic_load_explicit(&map->size, memory_order_relaxed);
+}
+
+void smap_lock_all(StripedMap* map)
+{
+    for (int s = 0; s < SMAP_STRIPES; ++s)
+        CHECK(pthread_rwlock_rdlock(&map->stripes[s].lock));
+}
+
+void smap_unlock_all(StripedMap* map)
+{
+    for (int s = SMAP_STRIPES - 1; s >= 0; --s)
+        CHECK(pthread_rwlock_unlock(&map->stripes[s].lock));
+}
+
+StripedMapIterator smap_iterator_after(StripedMap* map, const char* after)
+{
+    StripedMapIterator it;
+    for (int s = 0; s < SMAP_STRIPES; ++s) {
+        it.heads[s] = NULL;
+        if (map->stripes[s].names) {
+            it.stripes[s] = slist_iterator_after(map->stripes[s].names, after);
+            slist_next(&it.stripes[s], &it.heads[s]);
+        }
+    }
+    return it;
+}
+
+bool smap_next(StripedMap* map, StripedMapIterator* it, const char** key, void** value)
+{
+    int min = -1;
+    for (int s = 0; s < SMAP_STRIPES; ++s) {
+        if (it->heads[s] && (min < 0 || strcmp(it->heads[s], it->heads[min]) < 0))
+            min = s;
+    }
+    if (min < 0)
+        return false;
+    *key = it->heads[min];
+    if (value)
+        *value = hmap_get(map->stripes[min].map, *key);
+    if (!slist_next(&it->stripes[min], &it->heads[min]))
+        it->heads[min] = NULL;
+    return true;
+}
@@ -0,0 +1,72 @@
+#pragma once
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "SharedArena.h"
+#include "SkipList.h"
+
+// Number of independently locked parts of a map.
+#define SMAP_STRIPES 8
+
+// A mapping from keys to values, like HashMap, split into SMAP_STRIPES
+// stripes by a hash of the key. Every stripe has its own read-write lock,
+// a HashMap for lookups and a SkipList keeping its keys sorted.
+// smap_get, smap_insert and smap_remove lock only the stripe of the key,
+// so operations on keys in different stripes run in parallel. Lookups
+// and iteration lock stripes shared, so they also run in parallel
+// with each other on the same stripe.
+// Stripes are allocated on first insert, so an empty map is small.
+typedef struct StripedMap StripedMap;
+
+// Create a new, empty map.
+StripedMap* smap_new();
+
+// Create a new, empty map whose memory comes from `arena` (from malloc
+// if it is NULL). Stripes of a map in an arena lock with process-shared
+// locks, so processes sharing the arena can use the map concurrently.
+// Returns NULL if the arena is full.
+StripedMap* smap_new_in(SharedArena* arena);
+
+// Clear the map and free its memory. This frees the keys, but not the values.
+void smap_free(StripedMap* map);
+
+// Get the value stored under `key`, or NULL if not present.
+void* smap_get(StripedMap* map, const char* key);
+
+// Insert a `value` under `key` and return true,
+// or do nothing and return false if `key` already exists in the map
+// or the arena of the map is full.
+// `value` must not be NULL.
+bool smap_insert(StripedMap* map, const char* key, void* value);
+
+// Remove the value under `key` and return true (the value is not free'd),
+// or do nothing and return false if `key` was not present.
+bool smap_remove(StripedMap* map, const char* key);
+
+// Return the number of elements in the map.
+size_t smap_size(StripedMap* map);
+
+// Lock all stripes shared, in a fixed order, or unlock them.
+// Iterating requires all stripes locked, unless the caller knows
+// no one else can modify the map. Other iterations and lookups can run
+// at the same time, smap_insert and smap_remove wait.
+void smap_lock_all(StripedMap* map);
+void smap_unlock_all(StripedMap* map);
+
+typedef struct StripedMapIterator StripedMapIterator;
+
+// Return an iterator to the first key strictly greater than `after`,
+// or to the first key of the map if `after` is NULL. See `smap_next`.
+StripedMapIterator smap_iterator_after(StripedMap* map, const char* after);
+
+// Set `*key` to the next key in lexicographic order and, if `value` is
+// not NULL, `*value` to its value, and move the iterator forward.
+// If there are no more elements, leaves `*key` unchanged and returns false.
+// The map cannot be modified between calls to `smap_iterator_after` and `smap_next`.
+bool smap_next(StripedMap* map, StripedMapIterator* it, const char** key, void** value);
+
+// Sorted keys of every stripe are merged on the fly.
+struct StripedMapIterator {
+    SkipListIterator stripes[SMAP_STRIPES];
+    const char* heads[SMAP_STRIPES]; // Next key of each stripe or NULL.
+};
@@ -0,0 +1,304 @@
+/* Author Mikołaj Szkaradek */
+#include "Trace.h"
+#include "err.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Size of the fixed part of a record in the file, see Trace.h.
+#define RECORD_HEADER_SIZE 33
+
+// Records are gathered per thread and written to the file in blocks,
+// so that recording does not make threads contend on the file.
+#define TRACE_BUFFER_SIZE (64 * 1024)
+
+typedef struct ThreadBuffer ThreadBuffer;
+
+struct ThreadBuffer {
+    ThreadBuffer* next; // Next buffer of the same recorder.
+    pthread_t owner;
+    uint32_t thread;
+    size_t used;
+    unsigned char data[TRACE_BUFFER_SIZE];
+};
+
+struct TraceRecorder {
+    FILE* file;
+    pthread_mutex_t lock; // Guards file and the list of buffers.
+    ThreadBuffer* buffers;
+    uint64_t id; // Never reused, tells stale thread buffers apart.
+    atomic_uint next_thread;
+};
+
+static atomic_uint_fast64_t next_recorder_id = 1;
+
+// Buffer of the current thread for the recorder with the given id,
+// the one it used last. Buffers for other recorders are in their lists.
+static _Thread_local struct {
+    uint64_t recorder_id;
+    ThreadBuffer* buffer;
+} local_buffer;
+
+TraceRecorder* trace_open(const char* filename)
+{
+    FILE* file = fopen(filename, "wb");
+    if (!file)
+        return NULL;
+    if (fwrite(TRACE_MAGIC, 1, strlen(TRACE_MAGIC), file) != strlen(TRACE_MAGIC)) {
+        fclose(file);
+        return NULL;
+    }
+    TraceRecorder* recorder = malloc(sizeof(TraceRecorder));
+    CHECK_PTR(recorder);
+    recorder->file = file;
+    CHECK(pthread_mutex_init(&recorder->lock, 0));
+    recorder->buffers = NULL;
+    recorder->id = atomic_fetch_add(&next_recorder_id, 1);
+    atomic_init(&recorder->next_thread, 0);
+    return recorder;
+}
+
+// Write `size` bytes to the file. Caller holds recorder->lock.
+static void write_out(TraceRecorder* recorder, const void* data, size_t size)
+{
+    if (size && fwrite(data, 1, size, recorder->file) != size)
+        syserr("Writing trace failed");
+}
+
+// Write out the buffer contents. Caller holds recorder->lock.
+static void flush_buffer(TraceRecorder* recorder, ThreadBuffer* buffer)
+{
+    write_out(recorder, buffer->data, buffer->used);
+    buffer->used = 0;
+}
+
+void trace_close(TraceRecorder* recorder)
+{
+    if (!recorder)
+        return;
+    for (ThreadBuffer* b = recorder->buffers; b;) {
+        ThreadBuffer* next = b->next;
+        flush_buffer(recorder, b);
+        free(b);
+        b = next;
+    }
+    if (fclose(recorder->file))
+        syserr("Closing trace failed");
+    CHECK(pthread_mutex_destroy(&recorder->lock));
+    free(recorder);
+}
+
+uint64_t trace_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static ThreadBuffer* get_thread_buffer(TraceRecorder* recorder)
+{
+    if (local_buffer.recorder_id == recorder->id)
+        return local_buffer.buffer;
+
+    // A thread switching between recorders keeps its buffer, and so its
+    // thread number, in each of them. A buffer of a thread that ended can
+    // be taken over by a new thread with the same pthread_t, its records
+    // still come one after another.
+    pthread_t self = pthread_self();
+    CHECK(pthread_mutex_lock(&recorder->lock));
+    ThreadBuffer* buffer = recorder->buffers;
+    while (buffer && !pthread_equal(buffer->owner, self))
+        buffer = buffer->next;
+    if (!buffer) {
+        buffer = malloc(sizeof(ThreadBuffer));
+        CHECK_PTR(buffer);
+        buffer->owner = self;
+        buffer->thread = atomic_fetch_add(&recorder->next_thread, 1);
+        buffer->used = 0;
+        buffer->next = recorder->buffers;
+        recorder->buffers = buffer;
+    }
+    CHECK(pthread_mutex_unlock(&recorder->lock));
+
+    local_buffer.recorder_id = recorder->id;
+    local_buffer.buffer = buffer;
+    return buffer;
+}
+
+// Copy `size` bytes of `value` to *position and advance it.
+static void put(unsigned char** position, const void* value, size_t size)
+{
+    memcpy(*position, value, size);
+    *position += size;
+}
+
+// Return the length of `string` as stored in a record, at most UINT16_MAX.
+static uint16_t record_length(const char* string)
+{
+    return string ? strnlen(string, UINT16_MAX) : 0;
+}
+
+void trace_record(TraceRecorder* recorder, TraceOp op, const char* path,
+                  const char* target, uint32_t limit, uint64_t start, int result)
+{
+    uint64_t duration = trace_now() - start;
+    ThreadBuffer* buffer = get_thread_buffer(recorder);
+    uint16_t path_len = record_length(path);
+    uint16_t target_len = record_length(target);
+    size_t size = RECORD_HEADER_SIZE + path_len + target_len;
+
+    uint8_t op_byte = op;
+    int32_t result32 = result;
+    unsigned char header[RECORD_HEADER_SIZE];
+    unsigned char* position = header;
+    put(&position, &op_byte, sizeof(op_byte));
+    put(&position, &path_len, sizeof(path_len));
+    put(&position, &target_len, sizeof(target_len));
+    put(&position, &buffer->thread, sizeof(buffer->thread));
+    put(&position, &limit, sizeof(limit));
+    put(&position, &result32, sizeof(result32));
+    put(&position, &start, sizeof(start));
+    put(&position, &duration, sizeof(duration));
+
+    if (buffer->used + size > TRACE_BUFFER_SIZE) {
+        CHECK(pthread_mutex_lock(&recorder->lock));
+        flush_buffer(recorder, buffer);
+        // A record that does not fit even in an empty buffer skips it.
+        if (size > TRACE_BUFFER_SIZE) {
+            write_out(recorder, header, RECORD_HEADER_SIZE);
+            write_out(recorder, path, path_len);
+            write_out(recorder, target, target_len);
+        }
+        CHECK(pthread_mutex_unlock(&recorder->lock));
+        if (size > TRACE_BUFFER_SIZE)
+            return;
+    }
+
+    position = buffer->data + buffer->used;
+    put(&position, header, RECORD_HEADER_SIZE);
+    if (path_len)
+        put(&position, path, path_len);
+    if (target_len)
+        put(&position, target, target_len);
+    buffer->used += size;
+}
+
+// Copy `size` bytes from *position to `value` and advance it.
+static void get(const unsigned char** position, void* value, size_t size)
+{
+    memcpy(value, *position, size);
+    *position += size;
+}
+
+// Return a null-terminated copy of `len` bytes, or NULL if len is 0.
+static char* copy_string(const unsigned char* data, size_t len)
+{
+    if (len == 0)
+        return NULL;
+    char* result = malloc(len + 1);
+    CHECK_PTR(result);
+    memcpy(result, data, len);
+    result[len] = '\0';
+    return result;
+}
+
+// Order records by start time, keeping setup records first
+// with every folder after its parent.
+static int compare_records(const void* p1, const void* p2)
+{
+    const TraceRecord* r1 = p1;
+    const TraceRecord* r2 = p2;
+    if ((r1->op == TRACE_OP_SETUP) != (r2->op == TRACE_OP_SETUP))
+        return r1->op == TRACE_OP_SETUP ? -1 : 1;
+    if (r1->op == TRACE_OP_SETUP)
+        return (int)strlen(r1->path) - (int)strlen(r2->path);
+    if (r1->start != r2->start)
+        return r1->start < r2->start ? -1 : 1;
+    if (r1->thread != r2->thread)
+        return r1->thread < r2->thread ? -1 : 1;
+    return 0;
+}
+
+TraceRecord* trace_read_all(const char* filename, size_t* count)
+{
+    FILE* file = fopen(filename, "rb");
+    if (!file)
+        return NULL;
+    size_t magic_len = strlen(TRACE_MAGIC);
+    char magic[16];
+    if (fread(magic, 1, magic_len, file) != magic_len || memcmp(magic, TRACE_MAGIC, magic_len)) {
+        fclose(file);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    size_t n = 0, capacity = 1024;
+    TraceRecord* records = malloc(capacity * sizeof(TraceRecord));
+    CHECK_PTR(records);
+    unsigned char header[RECORD_HEADER_SIZE];
+    unsigned char strings[2 * UINT16_MAX];
+    size_t read;
+    while ((read = fread(header, 1, RECORD_HEADER_SIZE, file)) == RECORD_HEADER_SIZE) {
+        if (n == capacity) {
+            capacity *= 2;
+            records = realloc(records, capacity * sizeof(TraceRecord));
+            CHECK_PTR(records);
+        }
+        TraceRecord* r = &records[n];
+        const unsigned char* position = header;
+        uint8_t op_byte;
+        uint16_t path_len, target_len;
+        get(&position, &op_byte, sizeof(op_byte));
+        get(&position, &path_len, sizeof(path_len));
+        get(&position, &target_len, sizeof(target_len));
+        get(&position, &r->thread, sizeof(r->thread));
+        get(&position, &r->limit, sizeof(r->limit));
+        get(&position, &r->result, sizeof(r->result));
+        get(&position, &r->start, sizeof(r->start));
+        get(&position, &r->duration, sizeof(r->duration));
+        size_t strings_len = (size_t)path_len + target_len;
+        if (op_byte >= TRACE_OP_COUNT || fread(strings, 1, strings_len, file) != strings_len) {
+            read = 1; // Report malformed file below.
+            break;
+        }
+        r->op = op_byte;
+        r->path = copy_string(strings, path_len);
+        r->target = copy_string(strings + path_len, target_len);
+        n++;
+    }
+    fclose(file);
+    if (read != 0) {
+        trace_records_free(records, n);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    qsort(records, n, sizeof(TraceRecord), compare_records);
+    *count = n;
+    return records;
+}
+
+void trace_records_free(TraceRecord* records, size_t count)
+{
+    if (!records)
+        return;
+    for (size_t i = 0; i < count; ++i) {
+        free(records[i].path);
+        free(records[i].target);
+    }
+    free(records);
+}
+
+const char* trace_op_name(TraceOp op)
+{
+    static const char* names[TRACE_OP_COUNT] = {
+        "setup", "list", "list_range", "create", "remove", "move", "create_all", "copy"
+    };
+    if (op >= TRACE_OP_COUNT)
+        return "unknown";
+    return names[op];
+}
@@ -0,0 +1,70 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Binary log of tree operations, used to replay real workloads.
+// A trace file starts with TRACE_MAGIC followed by records of the form
+// (all integers in host byte order):
+//     u8 op, u16 path length, u16 target length, u32 thread, u32 limit,
+//     i32 result, u64 start, u64 duration, path bytes, target bytes.
+// Records of one thread are in order, records of different threads
+// are interleaved in blocks and have to be ordered by start time.
+
+#define TRACE_MAGIC "TREETRC1"
+
+typedef enum TraceOp {
+    TRACE_OP_SETUP, // Folder that existed when recording started.
+    TRACE_OP_LIST,
+    TRACE_OP_LIST_RANGE, // Target holds after_name, limit holds limit.
+    TRACE_OP_CREATE,
+    TRACE_OP_REMOVE,
+    TRACE_OP_MOVE,
+    TRACE_OP_CREATE_ALL,
+    TRACE_OP_COPY,
+    TRACE_OP_COUNT,
+} TraceOp;
+
+// A single operation read back from a trace file.
+// `path` and `target` are NULL when the operation had no such argument.
+typedef struct TraceRecord {
+    TraceOp op;
+    uint32_t thread; // Small number assigned to the calling thread.
+    uint32_t limit;
+    int32_t result; // Return value, for tree_list 0 or -1 if it was NULL.
+    uint64_t start; // Nanoseconds of CLOCK_MONOTONIC when the call began.
+    uint64_t duration; // Nanoseconds the call took.
+    char* path;
+    char* target;
+} TraceRecord;
+
+typedef struct TraceRecorder TraceRecorder;
+
+// Create a recorder writing to `filename`, truncating it.
+// Returns NULL and sets errno if the file cannot be opened.
+TraceRecorder* trace_open(const char* filename);
+
+// Write out everything still buffered and free the recorder.
+// No thread may be recording with it at that time.
+void trace_close(TraceRecorder* recorder);
+
+// Return current CLOCK_MONOTONIC time in nanoseconds.
+uint64_t trace_now();
+
+// Log one call which started at `start` and has just returned `result`.
+// Safe to call from many threads, each thread appends to its own buffer.
+// Strings longer than UINT16_MAX bytes are cut to that length.
+void trace_record(TraceRecorder* recorder, TraceOp op, const char* path,
+                  const char* target, uint32_t limit, uint64_t start, int result);
+
+// Read the whole trace from `filename`, ordered by start time.
+// Saves the number of records into `count`.
+// Returns NULL and sets errno if the file is missing or malformed.
+// The caller should free the result with trace_records_free.
+TraceRecord* trace_read_all(const char* filename, size_t* count);
+
+// Free an array returned by trace_read_all.
+void trace_records_free(TraceRecord* records, size_t count);
+
+// Return a short name of the operation, e.g. "create".
+const char* trace_op_name(TraceOp op);
@@ -1,29 +1,132 @@
 /* Author Mikołaj Szkaradek */
+#include <assert.h>
 #include <errno.h>
 #include "path_utils.h"
-#include "HashMap.h"
+#include "BloomFilter.h"
+#include "SharedArena.h"
+#include "StripedMap.h"
+#include "EventRing.h"
+#include "Trace.h"
 #include "Tree.h"
+#include "TreeImage.h"
 #include "readers-writers-template.h"
 #include "err.h"
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #define NEW_ERROR -11
 
+// tree_list_each copies names out in batches of this many bytes.
+#define LIST_BATCH_SIZE 4096
+
+// Number of undelivered events each watch can hold.
+#define WATCH_RING_CAPACITY 1024
+
+// tree_copy builds copies of at least COPY_PARALLEL_MIN nodes
+// on up to COPY_MAX_THREADS threads.
+#define COPY_PARALLEL_MIN 4096
+#define COPY_MAX_THREADS 8
+
+// Nodes waiting for combined creates and removes share this many
+// mutexes and condition variables, chosen by the address of the node.
+#define COMBINE_STRIPES 16
+
+// A combiner applies at most this many batches in one go,
+// so it does not work for others forever.
+#define COMBINE_PASSES 4
+
+typedef struct CombinedOp CombinedOp;
+
+typedef struct CombineStripe {
+    pthread_mutex_t lock;
+    pthread_cond_t done; // Broadcast whenever a combiner finishes.
+} CombineStripe;
+
+// State shared by all nodes of one tree.
+// Watch lists of all nodes are guarded by watch_library: publishers
+// enter it as readers, tree_watch and tree_unwatch as writers.
+// recorder, if set, logs every operation on the tree.
+// arena is NULL unless the tree lives in a segment shared between
+// processes, then all nodes and the context itself are allocated there.
+// filters tells whether children of the root keep Bloom filters, it
+// changes only under a writer in the root.
+// combining tells whether creates and removes that need a writer are
+// combined (see combine), it is never set if arena is set.
+// generation counts changes of the tree, it goes up under the locks of
+// each change, so a freeze in between sees exactly the changes counted.
+typedef struct TreeContext {
+    SharedArena* arena;
+    bool filters;
+    atomic_bool combining;
+    atomic_size_t generation;
+    CombineStripe stripes[COMBINE_STRIPES]; // Initialized only without arena.
+    struct readwrite watch_library;
+    _Atomic(TraceRecorder*) recorder;
+} TreeContext;
+
+struct TreeWatch {
+    TreeContext* context;
+    Tree* folder; // NULL once the watched folder was removed.
+    int flags;
+    EventRing* events;
+    TreeWatch* next; // Next watch on the same folder.
+};
+
 // Each Tree stores a pointer to its parent, pointer to
-// struct readwrite and a Hashmap of subtrees.
+// struct readwrite and a StripedMap of subtrees.
 // Keys in the map are folder names, values are whole subtrees.
+// The map locks its stripes itself, so folders can be added under
+// a reader in the library. A writer is needed only to take a subtree
+// out (tree_remove, tree_move), which must wait until no one is inside.
+//
+// A node stands for a whole chain of folders, each one the only subfolder
+// of the previous one: the folder under its key in the parent and
+// chain_length folders below it, named by components of `chain`
+// ("/b/c/" after a node under key "a" stands for a, a/b and a/b/c).
+// Folders inside the chain are called implicit. subTrees, watches and
+// descendants belong to the last folder of the chain. A chain changes
+// only under a writer in its node or above it.
+//
+// If filters are on, each child of the root has a Bloom filter of paths
+// of all folders below its first one, relative to it ("b/c/" for /a/b/c/).
+// Lookups check it after entering the child, so most paths that do not
+// exist are rejected without going deeper. Created and moved folders are
+// added at once, removed ones stay until the filter is built again.
+// Users of the filter hold a lock in its node, it is replaced under a writer.
 typedef struct Tree {
     Tree* parent;
     struct readwrite* library; // Each node has its own library.
-    HashMap* subTrees;
+    StripedMap* subTrees;
+    TreeContext* context; // Same for all nodes of the tree.
+    TreeWatch* watches; // Watches registered on this folder.
+    // Length of watches, read without watch_library, so mutations far from
+    // any watch skip publishing without touching shared state.
+    atomic_int watch_count;
+    // Number of all folders below this one. Ancestors of a changed folder
+    // hold only readers, so concurrent changes update it with atomic deltas.
+    atomic_size_t descendants;
+    char* chain; // A path, NULL for a single folder. Never set for the root.
+    size_t chain_length; // Number of components of chain.
+    BloomFilter* filter; // Only in children of the root, NULL if filters are off.
+    _Atomic(CombinedOp*) pending; // Published operations waiting for a combiner.
+    atomic_bool combining; // Whether someone applies them now.
+    atomic_int waiting; // Threads sleeping on the stripe of the node until it ends.
 } Tree;
 
-// Pair of tree* and bool returned by let_readers_and_writer_in function.
+// Pair of tree* and bool returned by let_readers_and_writer_in function,
+// with the reached folder: the node holding it and its place in the chain.
+// folder is tree, or a node below it if the chain changed before the
+// writer was taken.
 typedef struct PairTreeBool {
     Tree* tree;
     bool writing;
+    Tree* folder;
+    size_t level; // 0 for the first folder of the chain, chain_length for the last.
 } PairTB;
 
 // Removes writer from tree->library and changes pointer to parent.
@@ -48,192 +151,1150 @@ static void release_readers_and_writer(PairTB first_to_release) {
     }
 }
 
+// Return how many folders of the chain of `node` match the following
+// components of the parsed path, looking at most up to depth `depth`.
+// `top` is the depth of the first folder of the node.
+static size_t follow_chain(const Tree* node, size_t top, const char* path,
+                           const PathComponents* components, size_t depth) {
+    size_t n = node->chain_length;
+    if (n == 0) return 0;
+    if (n > depth - top) n = depth - top;
+    size_t from = components->slash[top];
+    // Both the chain and the path have '/' on both ends of each name,
+    // so matching bytes mean matching names. strncmp stops at the end
+    // of a chain shorter than the compared part of the path.
+    if (strncmp(node->chain, path + from, components->slash[top + n] - from + 1) == 0)
+        return n;
+    size_t matched = 0;
+    while (strncmp(node->chain + components->slash[top + matched] - from,
+                   path + components->slash[top + matched],
+                   components->slash[top + matched + 1] - components->slash[top + matched] + 1)
+           == 0)
+        ++matched;
+    return matched;
+}
+
+// Return the node holding the folder at depth `depth` of the parsed path,
+// searched from `node`, whose first folder is at depth `top`, and save
+// the place of the folder in the chain in `level`.
+// Return NULL if the folder does not exist.
+// The caller makes sure nothing below `node` changes.
+static Tree* find_folder(Tree* node, size_t top, const char* path,
+                         const PathComponents* components, size_t depth, size_t* level) {
+    char component[MAX_FOLDER_NAME_LENGTH + 1];
+    while (node) {
+        *level = follow_chain(node, top, path, components, depth);
+        if (top + *level == depth) return node;
+        if (*level < node->chain_length) return NULL;
+        path_component(path, components, top + *level, component);
+        node = (Tree*)smap_get(node->subTrees, component);
+        top += *level + 1;
+    }
+    return NULL;
+}
+
+// Return the hash of the key of the folder at depth `depth` (at least 2)
+// of the parsed path in the filter of the child of the root above it.
+static uint64_t folder_key(const char* path, const PathComponents* components, size_t depth) {
+    size_t from = components->slash[1] + 1;
+    return bloom_hash(BLOOM_HASH_START, path + from, components->slash[depth] + 1 - from);
+}
+
+// Replace the reader in locked->tree, which holds the reached folder,
+// with a writer. The chain could change when no lock was held, so the
+// folder at depth `depth` is searched for again.
+// If it no longer exists, everything is released and locked->tree is NULL.
+static void upgrade_to_writer(PairTB* locked, const char* path,
+                              const PathComponents* components, size_t depth) {
+    Tree* node = locked->tree;
+    size_t top = depth - locked->level;
+    rw_reader_final_protocol(node->library);
+    rw_writer_preliminary_protocol(node->library);
+    locked->writing = true;
+    locked->folder = find_folder(node, top, path, components, depth, &locked->level);
+    if (!locked->folder) {
+        release_readers_and_writer(*locked);
+        locked->tree = NULL;
+    }
+}
+
 // Function places one reader in each library on the path.
 // If writing is true function places writer instead of reader
-// in the last folder of the path.
-// If path doesn't exist it will stop at the end of existing part.
-// Return last tree on the path and bool which value depends on
-// successful locking of the whole path.
+// in the last node of the path.
+// Only the first `depth` components of the parsed path are followed,
+// a whole chain of folders is passed with one reader.
+// Return the last node on the path and bool which value depends on
+// successful locking of the whole path, together with the folder reached.
 // It's true when there is a writer in the returned tree library.
+// If path doesn't exist, tree is NULL and nothing stays locked.
 // We assume that the path is valid.
-static PairTB let_readers_and_writer_in(Tree* tree, const char* path, bool writing) {
+static PairTB let_readers_and_writer_in(Tree* tree, const char* path,
+                                        const PathComponents* components,
+                                        size_t depth, bool writing) {
     PairTB result;
     result.tree = NULL;
     result.writing = false;
+    result.folder = NULL;
+    result.level = 0;
     if (!tree) return result;
     char component[MAX_FOLDER_NAME_LENGTH + 1];
-    const char* subpath = path;
 
     Tree *current = tree;
-    while ((subpath = split_path(subpath, component))) {
-        result.tree = current;
+    size_t top = 0; // Depth of the first folder of current.
+    while (current) {
         rw_reader_preliminary_protocol(current->library);
-        current = (Tree*)hmap_get(current->subTrees, component);
-        if (!current) {
-            release_readers_and_writer(result);
-            result.tree = NULL;
+        result.tree = current;
+        // Most paths that do not exist end here, in a child of the root.
+        if (top == 1 && depth > 1 && current->filter
+            && !bloom_may_contain(current->filter, folder_key(path, components, depth)))
+            break;
+        size_t level = follow_chain(current, top, path, components, depth);
+        if (top + level == depth) {
+            result.folder = current;
+            result.level = level;
+            // Whether this is the last node is known only after reading
+            // its chain, so the writer replaces a reader.
+            if (writing) upgrade_to_writer(&result, path, components, depth);
             return result;
         }
+        if (level < current->chain_length) break;
+        path_component(path, components, top + level, component);
+        current = (Tree*)smap_get(current->subTrees, component);
+        top += level + 1;
     }
 
-    result.tree = current;
-    result.writing = writing;
-    if (writing) rw_writer_preliminary_protocol(current->library);
-    else rw_reader_preliminary_protocol(current->library);
+    release_readers_and_writer(result);
+    result.tree = NULL;
     return result;
 }
 
-// Return a pointer to tree which represents the folder that
-// the path leads to.
-// We assume that the path is valid.
-static Tree* find_path_subtree(Tree* tree, const char* path) {
-    if (!tree) return NULL;
-    Tree* current = tree;
-    char component[MAX_FOLDER_NAME_LENGTH + 1];
-    const char* subpath = path;
+// Copy to `name` the name of the only subfolder of the folder at `level`
+// of the chain of `node`, which must be implicit.
+static void chain_name(const Tree* node, size_t level, char* name) {
+    const char* start = node->chain;
+    for (size_t i = 0; i < level; ++i)
+        start = strchr(start + 1, '/');
+    const char* end = strchr(start + 1, '/');
+    memcpy(name, start + 1, end - start - 1);
+    name[end - start - 1] = '\0';
+}
 
-    while ((subpath = split_path(subpath, component))) {
-        current = (Tree*)hmap_get(current->subTrees, component);
-        if (!current) return NULL;
+// Return whether the folder at `level` of the chain of `node` has
+// a subfolder `name`. The caller holds a lock in node or above it.
+static bool has_child(Tree* node, size_t level, const char* name) {
+    if (level < node->chain_length) {
+        char only[MAX_FOLDER_NAME_LENGTH + 1];
+        chain_name(node, level, only);
+        return strcmp(only, name) == 0;
     }
-
-    return current;
+    return smap_get(node->subTrees, name) != NULL;
 }
 
-Tree* tree_new() {
-    Tree* tree = malloc(sizeof(Tree));
-    CHECK_PTR(tree);
-    tree->parent = NULL;
-    tree->library = malloc(sizeof(struct readwrite));
-    CHECK_PTR(tree->library);
-    rw_init(tree->library);
-    tree->subTrees = hmap_new();
+// Return a new empty folder belonging to the tree described by context,
+// or NULL if the arena is full.
+static Tree* node_new(Tree* parent, TreeContext* context) {
+    // The library shares one allocation with the node.
+    Tree* tree = arena_alloc(context->arena, sizeof(Tree) + sizeof(struct readwrite));
+    if (!tree) return NULL;
+    tree->subTrees = smap_new_in(context->arena);
+    if (!tree->subTrees) {
+        arena_free(context->arena, tree);
+        return NULL;
+    }
+    tree->parent = parent;
+    tree->library = (struct readwrite*)(tree + 1);
+    if (context->arena) rw_init_shared(tree->library);
+    else rw_init(tree->library);
+    tree->context = context;
+    tree->watches = NULL;
+    atomic_init(&tree->watch_count, 0);
+    atomic_init(&tree->descendants, 0);
+    tree->chain = NULL;
+    tree->chain_length = 0;
+    tree->filter = NULL;
+    atomic_init(&tree->pending, NULL);
+    atomic_init(&tree->combining, false);
+    atomic_init(&tree->waiting, 0);
     return tree;
 }
 
-void tree_free(Tree* tree) {
+// Free the folder and all its subfolders.
+// Watches registered inside are detached, not free'd.
+// Caller must make sure no one else reads the watch lists.
+static void node_free(Tree* tree) {
     const char* key;
     void* value;
-    HashMapIterator it = hmap_iterator(tree->subTrees);
+    StripedMapIterator it = smap_iterator_after(tree->subTrees, NULL);
 
-    while (hmap_next(tree->subTrees, &it, &key, &value)) {
-        tree_free((Tree*)value);
+    while (smap_next(tree->subTrees, &it, &key, &value)) {
+        node_free((Tree*)value);
     }
+    for (TreeWatch* w = tree->watches; w; w = w->next)
+        w->folder = NULL;
+    SharedArena* arena = tree->context->arena;
     rw_destroy(tree->library);
-    free(tree->library);
-    hmap_free(tree->subTrees);
+    smap_free(tree->subTrees);
+    arena_free(arena, tree->chain);
+    if (tree->filter) bloom_free(tree->filter);
 
-    free(tree);
+    arena_free(arena, tree);
 }
 
-char* tree_list(Tree* tree, const char* path) {
-    if (!is_path_valid(path)) return NULL;
-    PairTB first_to_release = let_readers_and_writer_in(tree, path, false);
-    if (!first_to_release.tree) return NULL;
+// Add delta to the descendant count of every folder from `folder` up to,
+// but excluding, `stop`. The caller holds locks on all of them.
+static void add_descendants(Tree* folder, Tree* stop, size_t delta) {
+    for (Tree* t = folder; t != stop; t = t->parent)
+        atomic_fetch_add_explicit(&t->descendants, delta, memory_order_relaxed);
+}
 
-    Tree* folder = find_path_subtree(tree, path);
+// Return a single allocation holding the event and copies of both paths.
+static TreeEvent* make_event(TreeEventType type, const char* path, const char* target) {
+    size_t path_size = strlen(path) + 1;
+    size_t target_size = target ? strlen(target) + 1 : 0;
+    TreeEvent* event = malloc(sizeof(TreeEvent) + path_size + target_size);
+    CHECK_PTR(event);
+    event->type = type;
+    event->path = (char*)(event + 1);
+    memcpy(event->path, path, path_size);
+    event->target = NULL;
+    if (target) {
+        event->target = event->path + path_size;
+        memcpy(event->target, target, target_size);
+    }
+    return event;
+}
 
-    if (!folder) {
-        release_readers_and_writer(first_to_release);
+// Push a copy of the event to every watch of the folder that wants it.
+// `direct` tells whether the changed folder is a child of `folder`.
+static void deliver_event(Tree* folder, bool direct, TreeEventType type,
+                          const char* path, const char* target) {
+    for (TreeWatch* w = folder->watches; w; w = w->next) {
+        if (!(w->flags & TREE_WATCH_SUBTREE) && !direct) continue;
+        TreeEvent* event = make_event(type, path, target);
+        if (!ring_push(w->events, event))
+            free(event);
+    }
+}
+
+// Return whether any folder from `folder` up to the root has a watch.
+// The caller holds locks on all of them.
+static bool watched_above(Tree* folder) {
+    for (Tree* t = folder; t; t = t->parent) {
+        if (atomic_load_explicit(&t->watch_count, memory_order_relaxed) > 0)
+            return true;
+    }
+    return false;
+}
+
+// Count a change of a child of `parent` in the generation of the tree
+// and notify watches about it.
+// For moves `target_parent` is the parent of target and `lca` is the
+// deepest common ancestor of both parents, otherwise both are NULL.
+// Every folder on the way to the root is locked by the caller, either
+// directly or through a writer in lca, so parent pointers are stable.
+static void publish_event(Tree* parent, Tree* target_parent, Tree* lca,
+                          TreeEventType type, const char* path, const char* target) {
+    TreeContext* context = parent->context;
+    atomic_fetch_add_explicit(&context->generation, 1, memory_order_relaxed);
+    if (!watched_above(parent) && !(target_parent && watched_above(target_parent)))
+        return;
+
+    rw_reader_preliminary_protocol(&context->watch_library);
+    Tree* t = parent;
+    for (; t != lca; t = t->parent)
+        deliver_event(t, t == parent, type, path, target);
+    if (target_parent) {
+        for (Tree* u = target_parent; u != lca; u = u->parent)
+            deliver_event(u, u == target_parent, type, path, target);
+    }
+    for (; t; t = t->parent)
+        deliver_event(t, t == parent || t == target_parent, type, path, target);
+    rw_reader_final_protocol(&context->watch_library);
+}
+
+// Detach all watches in the folder that is about to be removed.
+static void detach_watches(Tree* folder) {
+    TreeContext* context = folder->context;
+    if (atomic_load_explicit(&folder->watch_count, memory_order_relaxed) == 0)
+        return;
+
+    rw_writer_preliminary_protocol(&context->watch_library);
+    for (TreeWatch* w = folder->watches; w; w = w->next)
+        w->folder = NULL;
+    folder->watches = NULL;
+    atomic_store_explicit(&folder->watch_count, 0, memory_order_relaxed);
+    rw_writer_final_protocol(&context->watch_library);
+}
+
+// Return whether any watch is registered on the folder. The caller holds
+// a writer in it or above, so no watch can be added meanwhile.
+static bool has_watches(Tree* folder) {
+    return atomic_load_explicit(&folder->watch_count, memory_order_relaxed) > 0;
+}
+
+// Move all watches of the last folder of `from` to `to`, when that folder
+// becomes the last one of `to`.
+static void move_watches(Tree* from, Tree* to) {
+    TreeContext* context = from->context;
+    if (atomic_load_explicit(&from->watch_count, memory_order_relaxed) == 0)
+        return;
+
+    rw_writer_preliminary_protocol(&context->watch_library);
+    to->watches = from->watches;
+    for (TreeWatch* w = to->watches; w; w = w->next)
+        w->folder = to;
+    from->watches = NULL;
+    atomic_store_explicit(&to->watch_count,
+                          atomic_load_explicit(&from->watch_count, memory_order_relaxed),
+                          memory_order_relaxed);
+    atomic_store_explicit(&from->watch_count, 0, memory_order_relaxed);
+    rw_writer_final_protocol(&context->watch_library);
+}
+
+// Set `*result` to a new chain made of `head` and `tail` (chains or NULL)
+// with `len` bytes of `middle`, a path, between them, or NULL if it is empty.
+// Returns false, leaving `*result` unchanged, if the arena is full.
+static bool join_chain(SharedArena* arena, const char* head, const char* middle,
+                       size_t len, const char* tail, char** result) {
+    size_t head_len = head ? strlen(head) - 1 : 0; // Without the last '/'.
+    size_t tail_len = tail ? strlen(tail) - 1 : 0; // Without the first '/'.
+    char* chain = NULL;
+    if (head_len + len + tail_len > 1) {
+        chain = arena_alloc(arena, head_len + len + tail_len + 1);
+        if (!chain) return false;
+        if (head) memcpy(chain, head, head_len);
+        memcpy(chain + head_len, middle, len);
+        memcpy(chain + head_len + len, tail ? tail + 1 : "", tail_len + 1);
+    }
+    *result = chain;
+    return true;
+}
+
+// Return a pointer to the '/' in front of component `level` of a chain.
+static char* chain_slash(char* chain, size_t level) {
+    for (size_t i = 0; i < level; ++i)
+        chain = strchr(chain + 1, '/');
+    return chain;
+}
+
+// Cut the chain of `node` to its first `level` folders.
+static void cut_chain(Tree* node, size_t level) {
+    if (level == 0) {
+        arena_free(node->context->arena, node->chain);
+        node->chain = NULL;
+    } else {
+        chain_slash(node->chain, level)[1] = '\0';
+    }
+    node->chain_length = level;
+}
+
+// Make the folder at `level` of the chain of `node` its last folder.
+// The rest of the chain moves, together with subfolders, watches and
+// the descendant count, to a new node which becomes the only subfolder.
+// Returns false, changing nothing, if the arena is full.
+// The caller holds a writer in node or above it.
+static bool split_chain(Tree* node, size_t level) {
+    char name[MAX_FOLDER_NAME_LENGTH + 1];
+    chain_name(node, level, name);
+    char* rest = chain_slash(node->chain, level + 1);
+    Tree* child = node_new(node, node->context);
+    if (!child) return false;
+    // The map of the child becomes the map of node, the child is put
+    // there first, so everything that can fail is done before any change.
+    if (!join_chain(node->context->arena, NULL, rest, strlen(rest), NULL, &child->chain)
+        || !smap_insert(child->subTrees, name, child)) {
+        node_free(child);
+        return false;
+    }
+    child->chain_length = node->chain_length - level - 1;
+
+    StripedMap* only_child = child->subTrees;
+    child->subTrees = node->subTrees;
+    node->subTrees = only_child;
+    const char* key;
+    void* value;
+    StripedMapIterator it = smap_iterator_after(child->subTrees, NULL);
+    while (smap_next(child->subTrees, &it, &key, &value))
+        ((Tree*)value)->parent = child;
+    move_watches(node, child);
+    size_t descendants = atomic_load_explicit(&node->descendants, memory_order_relaxed);
+    atomic_store_explicit(&child->descendants, descendants, memory_order_relaxed);
+    atomic_store_explicit(&node->descendants, descendants + node->chain_length - level,
+                          memory_order_relaxed);
+
+    cut_chain(node, level);
+    return true;
+}
+
+// Append `len` bytes of `middle`, a path, to the chain of `node`,
+// whose last folder has no subfolders and no watches.
+// Returns false, changing nothing, if the arena is full.
+static bool extend_chain(Tree* node, const char* middle, size_t len, size_t count) {
+    char* chain;
+    if (!join_chain(node->context->arena, node->chain, middle, len, NULL, &chain))
+        return false;
+    arena_free(node->context->arena, node->chain);
+    node->chain = chain;
+    node->chain_length += count;
+    return true;
+}
+
+// While the last folder of `node` has exactly one subfolder and nothing
+// keeps it apart (watches, being the root), take the subfolder into the chain.
+// If the arena is full, the subfolder just stays a node of its own.
+// The caller holds a writer in node or above it.
+static void merge_chain(Tree* node) {
+    while (node->parent && smap_size(node->subTrees) == 1 && !has_watches(node)) {
+        const char* key;
+        void* value;
+        StripedMapIterator it = smap_iterator_after(node->subTrees, NULL);
+        smap_next(node->subTrees, &it, &key, &value);
+        Tree* child = (Tree*)value;
+
+        char middle[MAX_FOLDER_NAME_LENGTH + 3];
+        int len = snprintf(middle, sizeof(middle), "/%s/", key);
+        char* chain;
+        if (!join_chain(node->context->arena, node->chain, middle, len, child->chain, &chain))
+            return;
+        middle[len - 1] = '\0'; // The name alone is middle + 1.
+        smap_remove(node->subTrees, middle + 1);
+        arena_free(node->context->arena, node->chain);
+        node->chain = chain;
+        node->chain_length += 1 + child->chain_length;
+
+        StripedMap* empty = node->subTrees;
+        node->subTrees = child->subTrees;
+        child->subTrees = empty;
+        it = smap_iterator_after(node->subTrees, NULL);
+        while (smap_next(node->subTrees, &it, &key, &value))
+            ((Tree*)value)->parent = node;
+        move_watches(child, node);
+        atomic_store_explicit(&node->descendants,
+                              atomic_load_explicit(&child->descendants, memory_order_relaxed),
+                              memory_order_relaxed);
+        node_free(child);
+    }
+}
+
+// Return the child of the root holding `node`, or NULL for the root.
+static Tree* top_node(Tree* node) {
+    if (!node->parent) return NULL;
+    while (node->parent->parent)
+        node = node->parent;
+    return node;
+}
+
+// Add to the filter of `top`, if it has one, keys of folders at depths
+// from `from` (at least 2) to `to` of the parsed path.
+static void filter_add_path(Tree* top, const char* path, const PathComponents* components,
+                            size_t from, size_t to) {
+    if (!top || !top->filter) return;
+    uint64_t hash = folder_key(path, components, from);
+    bloom_add(top->filter, hash);
+    for (size_t depth = from + 1; depth <= to; ++depth) {
+        size_t start = components->slash[depth - 1] + 1;
+        hash = bloom_hash(hash, path + start, components->slash[depth] + 1 - start);
+        bloom_add(top->filter, hash);
+    }
+}
+
+// Add keys of all folders below the first folder of `node` to the filter,
+// `hash` is the key of that folder. The caller makes sure nothing below changes.
+static void filter_add_below(BloomFilter* filter, Tree* node, uint64_t hash) {
+    for (const char* c = node->chain; c && c[1]; c = strchr(c + 1, '/')) {
+        hash = bloom_hash(hash, c + 1, strchr(c + 1, '/') - c);
+        bloom_add(filter, hash);
+    }
+    const char* key;
+    void* value;
+    StripedMapIterator it = smap_iterator_after(node->subTrees, NULL);
+    while (smap_next(node->subTrees, &it, &key, &value)) {
+        uint64_t child = bloom_hash(bloom_hash(hash, key, strlen(key)), "/", 1);
+        bloom_add(filter, child);
+        filter_add_below(filter, (Tree*)value, child);
+    }
+}
+
+// Give `node`, which has just become a child of the root, a filter of all
+// its folders if filters are on. The caller makes sure nothing below changes.
+static void filter_attach(Tree* node) {
+    if (!node->context->filters) return;
+    size_t count = node->chain_length
+        + atomic_load_explicit(&node->descendants, memory_order_relaxed);
+    // Twice the size needed, so it is not overdue again too soon.
+    // Without memory for it the node simply has no filter.
+    node->filter = bloom_new_in(node->context->arena, 2 * count);
+    if (node->filter) filter_add_below(node->filter, node, BLOOM_HASH_START);
+}
+
+// Note that `count` folders below `top` were removed or moved away.
+static void filter_forget(Tree* top, size_t count) {
+    if (top && top->filter) bloom_forget(top->filter, count);
+}
+
+static bool filter_overdue(Tree* top) {
+    return top && top->filter && bloom_overdue(top->filter);
+}
+
+// Build again the filter of the child of the root holding the first folder
+// of the parsed path, unless someone already did it. Callers first release
+// everything, the writer it takes stops all operations below the child.
+static void rebuild_filter(Tree* tree, const char* path, const PathComponents* components) {
+    PairTB first_to_release = let_readers_and_writer_in(tree, path, components, 1, true);
+    if (!first_to_release.tree) return;
+    Tree* node = first_to_release.folder;
+    if (filter_overdue(node)) {
+        bloom_free(node->filter);
+        node->filter = NULL;
+        filter_attach(node);
+    }
+    release_readers_and_writer(first_to_release);
+}
+
+// Return a new empty tree with its context, allocated from arena,
+// or NULL if the arena is full.
+static Tree* context_new(SharedArena* arena) {
+    TreeContext* context = arena_alloc(arena, sizeof(TreeContext));
+    if (!context) return NULL;
+    context->arena = arena;
+    Tree* root = node_new(NULL, context);
+    if (!root) {
+        arena_free(arena, context);
         return NULL;
     }
-    char* contents_string = make_map_contents_string(folder->subTrees);
+    context->filters = false;
+    atomic_init(&context->combining, false);
+    atomic_init(&context->generation, 0);
+    if (arena) rw_init_shared(&context->watch_library);
+    else rw_init(&context->watch_library);
+    for (int i = 0; !arena && i < COMBINE_STRIPES; ++i) {
+        CHECK(pthread_mutex_init(&context->stripes[i].lock, NULL));
+        CHECK(pthread_cond_init(&context->stripes[i].done, NULL));
+    }
+    atomic_init(&context->recorder, NULL);
+    return root;
+}
+
+Tree* tree_new() {
+    Tree* tree = context_new(NULL);
+    CHECK_PTR(tree);
+    return tree;
+}
+
+Tree* tree_new_shared(int fd) {
+    SharedArena* arena = arena_create(fd);
+    if (!arena) return NULL;
+    Tree* tree = context_new(arena);
+    if (!tree) {
+        arena_detach(arena);
+        errno = ENOMEM;
+        return NULL;
+    }
+    arena_set_root(arena, tree);
+    return tree;
+}
+
+Tree* tree_attach(int fd) {
+    SharedArena* arena = arena_attach(fd);
+    if (!arena) return NULL;
+    Tree* tree = arena_root(arena);
+    if (!tree) {
+        arena_detach(arena);
+        errno = EINVAL;
+    }
+    return tree;
+}
+
+void tree_detach(Tree* tree) {
+    arena_detach(tree->context->arena);
+}
+
+void tree_free(Tree* tree) {
+    TreeContext* context = tree->context;
+    SharedArena* arena = context->arena;
+    node_free(tree);
+    rw_destroy(&context->watch_library);
+    for (int i = 0; !arena && i < COMBINE_STRIPES; ++i) {
+        CHECK(pthread_mutex_destroy(&context->stripes[i].lock));
+        CHECK(pthread_cond_destroy(&context->stripes[i].done));
+    }
+    arena_free(arena, context);
+    if (arena) arena_detach(arena);
+}
+
+// Return whether `name`, the only subfolder of an implicit folder, belongs
+// to a listing of at most `limit` names that come after `after_name`.
+static bool chain_listed(const char* name, const char* after_name, size_t limit) {
+    return limit > 0 && (!after_name || strcmp(name, after_name) > 0);
+}
+
+static char* list_folder(Tree* tree, const char* path, const char* after_name, size_t limit) {
+    PathComponents components;
+    if (!parse_path(path, &components)) return NULL;
+    PairTB first_to_release =
+        let_readers_and_writer_in(tree, path, &components, components.count, false);
+    if (!first_to_release.tree) return NULL;
+
+    Tree* folder = first_to_release.folder;
+    char* contents_string;
+    if (first_to_release.level < folder->chain_length) {
+        char name[MAX_FOLDER_NAME_LENGTH + 1];
+        chain_name(folder, first_to_release.level, name);
+        contents_string = strdup(chain_listed(name, after_name, limit) ? name : "");
+        CHECK_PTR(contents_string);
+    } else {
+        smap_lock_all(folder->subTrees);
+        contents_string = make_list_range_string(folder->subTrees, after_name, limit);
+        smap_unlock_all(folder->subTrees);
+    }
 
     release_readers_and_writer(first_to_release);
     return contents_string;
 }
 
-int tree_create(Tree* tree, const char* path) {
-    if (!is_path_valid(path)) return EINVAL;
-    if (strlen(path) == 1) return EEXIST;
+static int list_folder_into(Tree* tree, const char* path, char* buffer, size_t capacity,
+                            size_t* needed) {
+    PathComponents components;
+    if (!parse_path(path, &components)) return EINVAL;
+    PairTB first_to_release =
+        let_readers_and_writer_in(tree, path, &components, components.count, false);
+    if (!first_to_release.tree) return ENOENT;
 
-    char to_insert[MAX_FOLDER_NAME_LENGTH + 1];
-    char* subpath = make_path_to_parent(path, to_insert);
-    PairTB first_to_release = let_readers_and_writer_in(tree, subpath, true);
-    if (!first_to_release.tree) {
-        free(subpath);
-        return ENOENT;
+    Tree* folder = first_to_release.folder;
+    size_t size;
+    if (first_to_release.level < folder->chain_length) {
+        char name[MAX_FOLDER_NAME_LENGTH + 1];
+        chain_name(folder, first_to_release.level, name);
+        size = strlen(name) + 1;
+        if (size <= capacity)
+            memcpy(buffer, name, size);
+        else if (capacity > 0)
+            buffer[0] = '\0';
+    } else {
+        smap_lock_all(folder->subTrees);
+        size = write_list_range(folder->subTrees, NULL, SIZE_MAX, buffer, capacity);
+        smap_unlock_all(folder->subTrees);
     }
 
-    Tree* folder_parent = find_path_subtree(tree, subpath);
-    free(subpath);
+    release_readers_and_writer(first_to_release);
+    if (needed) *needed = size;
+    return size <= capacity ? 0 : ERANGE;
+}
+
+static int list_folder_each(Tree* tree, const char* path, TreeListCallback callback,
+                            void* arg) {
+    PathComponents components;
+    if (!parse_path(path, &components)) return EINVAL;
+
+    // Names are copied out in batches and the callback runs with nothing
+    // locked, so it can use the tree. Each next batch starts after the
+    // last name of the previous one.
+    char batch[LIST_BATCH_SIZE];
+    char after[MAX_FOLDER_NAME_LENGTH + 1];
+    bool first = true;
+    bool more = true;
+    while (more) {
+        PairTB first_to_release =
+            let_readers_and_writer_in(tree, path, &components, components.count, false);
+        if (!first_to_release.tree) return first ? ENOENT : 0;
 
-    if (!folder_parent) {
+        Tree* folder = first_to_release.folder;
+        size_t used = 0, last = 0;
+        more = false;
+        if (first_to_release.level < folder->chain_length) {
+            chain_name(folder, first_to_release.level, batch);
+            if (chain_listed(batch, first ? NULL : after, 1))
+                used = strlen(batch) + 1;
+        } else {
+            const char* key;
+            StripedMap* map = folder->subTrees;
+            smap_lock_all(map);
+            StripedMapIterator it = smap_iterator_after(map, first ? NULL : after);
+            while (smap_next(map, &it, &key, NULL)) {
+                size_t len = strlen(key) + 1;
+                if (used + len > LIST_BATCH_SIZE) {
+                    more = true;
+                    break;
+                }
+                memcpy(batch + used, key, len);
+                last = used;
+                used += len;
+            }
+            smap_unlock_all(map);
+        }
         release_readers_and_writer(first_to_release);
-        return ENOENT;
+        first = false;
+
+        if (more) strcpy(after, batch + last);
+        for (size_t i = 0; i < used; i += strlen(batch + i) + 1) {
+            if (!callback(batch + i, arg)) return 0;
+        }
+    }
+    return 0;
+}
+
+// Create folder `name` in the folder at `level` of the chain of `parent`.
+// An implicit parent is split off its chain first. A new subfolder of an
+// empty folder is appended to its chain instead of getting a node.
+// The caller holds a writer in parent or above it.
+static int create_in_chain(Tree* parent, size_t level, const char* path, const char* name) {
+    if (has_child(parent, level, name)) return EEXIST;
+    if (level < parent->chain_length && !split_chain(parent, level)) return ENOMEM;
+
+    if (smap_size(parent->subTrees) == 0 && parent->parent && !has_watches(parent)) {
+        char middle[MAX_FOLDER_NAME_LENGTH + 3];
+        int len = snprintf(middle, sizeof(middle), "/%s/", name);
+        if (!extend_chain(parent, middle, len, 1)) return ENOMEM;
+        add_descendants(parent->parent, NULL, 1);
+    } else {
+        Tree* child = node_new(parent, parent->context);
+        if (!child || !smap_insert(parent->subTrees, name, child)) {
+            if (child) node_free(child);
+            merge_chain(parent); // Undo the split, if there was one.
+            return ENOMEM;
+        }
+        add_descendants(parent, NULL, 1);
+    }
+    publish_event(parent, NULL, NULL, TREE_EVENT_CREATE, path, NULL);
+    return 0;
+}
+
+// Remove folder `name` from the folder at `level` of the chain of `parent`.
+// The caller holds a writer in parent or above it.
+static int remove_in_chain(Tree* parent, size_t level, const char* path, const char* name) {
+    if (!has_child(parent, level, name)) return ENOENT;
+    if (level < parent->chain_length) {
+        // Only the last folder of a chain can be empty, it is cut off.
+        if (level + 1 < parent->chain_length || smap_size(parent->subTrees) != 0)
+            return ENOTEMPTY;
+        detach_watches(parent);
+        cut_chain(parent, level);
+        filter_forget(top_node(parent), 1);
+        add_descendants(parent->parent, NULL, -1);
+        publish_event(parent, NULL, NULL, TREE_EVENT_REMOVE, path, NULL);
+        return 0;
+    }
+    Tree* to_remove = (Tree*)smap_get(parent->subTrees, name);
+    if (to_remove->chain_length != 0 || smap_size(to_remove->subTrees) != 0)
+        return ENOTEMPTY;
+    detach_watches(to_remove);
+    node_free(to_remove);
+    smap_remove(parent->subTrees, name);
+    filter_forget(top_node(parent), 1);
+    add_descendants(parent, NULL, -1);
+    publish_event(parent, NULL, NULL, TREE_EVENT_REMOVE, path, NULL);
+    merge_chain(parent);
+    return 0;
+}
+
+// A create or remove of folder `name` under the parsed path, published in
+// the node holding its parent, whose first folder is at depth `top`.
+// Everything it points to lives on the stack of the publishing thread,
+// which waits until done is set.
+struct CombinedOp {
+    bool create; // Remove otherwise.
+    const char* path;
+    const PathComponents* components;
+    const char* name;
+    size_t top;
+    int result;
+    bool overdue; // Whether the filter above needs rebuilding.
+    atomic_bool done;
+    CombinedOp* next;
+};
+
+static CombineStripe* combine_stripe(Tree* node) {
+    return &node->context->stripes[(uintptr_t)node / sizeof(Tree) % COMBINE_STRIPES];
+}
+
+// Apply one published operation. The parent is searched for again,
+// the chain of node could change since it was published.
+// The caller holds a writer in node.
+static int apply_combined(Tree* node, CombinedOp* op) {
+    size_t level;
+    Tree* parent = find_folder(node, op->top, op->path, op->components,
+                               op->components->count - 1, &level);
+    if (!parent) return ENOENT;
+    if (op->create) return create_in_chain(parent, level, op->path, op->name);
+    return remove_in_chain(parent, level, op->path, op->name);
+}
+
+// Take the writer in node once and apply, in the order of publishing,
+// all operations published there, also those published meanwhile.
+static void apply_pending(Tree* node) {
+    rw_writer_preliminary_protocol(node->library);
+    for (int pass = 0; pass < COMBINE_PASSES; ++pass) {
+        CombinedOp* batch = atomic_exchange_explicit(&node->pending, NULL, memory_order_acquire);
+        if (!batch) break;
+        CombinedOp* ordered = NULL;
+        while (batch) {
+            CombinedOp* next = batch->next;
+            batch->next = ordered;
+            ordered = batch;
+            batch = next;
+        }
+        for (CombinedOp* op = ordered; op; op = op->next)
+            op->result = apply_combined(node, op);
+        bool overdue = filter_overdue(top_node(node));
+        while (ordered) {
+            // The publisher may return as soon as done is set.
+            CombinedOp* next = ordered->next;
+            ordered->overdue = overdue;
+            atomic_store_explicit(&ordered->done, true, memory_order_release);
+            ordered = next;
+        }
+    }
+    rw_writer_final_protocol(node->library);
+}
+
+// Flat combining of operations that need a writer in locked->tree, the node
+// holding the parent, where locked holds a reader. Instead of each thread
+// waiting for the writer in turn, the operation is published in the node
+// and whoever gets the writer applies all published ones in one pass.
+// The rest wait for their results. On return locked holds readers only
+// above the node and op holds the result.
+static void combine(PairTB* locked, CombinedOp* op) {
+    Tree* node = locked->tree;
+    atomic_init(&op->done, false);
+    op->next = atomic_load_explicit(&node->pending, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&node->pending, &op->next, op,
+                                                  memory_order_release, memory_order_relaxed))
+        ;
+    // Readers above keep the node in its place until the result comes.
+    rw_reader_final_protocol(node->library);
+    locked->tree = node->parent;
+
+    CombineStripe* stripe = combine_stripe(node);
+    while (!atomic_load_explicit(&op->done, memory_order_acquire)) {
+        if (!atomic_exchange(&node->combining, true)) {
+            apply_pending(node);
+            atomic_store(&node->combining, false);
+            // Sleepers announce themselves before checking combining,
+            // so either they see it cleared or it sees them.
+            if (atomic_load(&node->waiting) > 0) {
+                CHECK(pthread_mutex_lock(&stripe->lock));
+                CHECK(pthread_cond_broadcast(&stripe->done));
+                CHECK(pthread_mutex_unlock(&stripe->lock));
+            }
+        } else {
+            CHECK(pthread_mutex_lock(&stripe->lock));
+            atomic_fetch_add(&node->waiting, 1);
+            while (atomic_load(&node->combining)
+                   && !atomic_load_explicit(&op->done, memory_order_acquire))
+                CHECK(pthread_cond_wait(&stripe->done, &stripe->lock));
+            atomic_fetch_sub(&node->waiting, 1);
+            CHECK(pthread_mutex_unlock(&stripe->lock));
+        }
     }
-    if (hmap_get(folder_parent->subTrees, to_insert)) {
+}
+
+static int create_folder(Tree* tree, const char* path) {
+    PathComponents components;
+    if (!parse_path(path, &components)) return EINVAL;
+    if (components.count == 0) return EEXIST;
+
+    char to_insert[MAX_FOLDER_NAME_LENGTH + 1];
+    path_component(path, &components, components.count - 1, to_insert);
+    // A reader in the parent is enough, only the stripe of the new name
+    // gets locked, so creates of other names in the same folder go on.
+    PairTB first_to_release =
+        let_readers_and_writer_in(tree, path, &components, components.count - 1, false);
+    if (!first_to_release.tree) return ENOENT;
+
+    Tree* folder_parent = first_to_release.folder;
+    if (has_child(folder_parent, first_to_release.level, to_insert)) {
         release_readers_and_writer(first_to_release);
         return EEXIST;
     }
+    // The key goes to the filter before the folder appears. The child of
+    // the root above the parent stays the same, the reader in the root is
+    // held all the time.
+    Tree* top = top_node(folder_parent);
+    filter_add_path(top, path, &components, components.count, components.count);
+    // Changing a chain needs a writer: splitting it at an implicit parent
+    // or extending it with the first subfolder of an empty folder.
+    if (first_to_release.level < folder_parent->chain_length
+        || (smap_size(folder_parent->subTrees) == 0 && folder_parent->parent)) {
+        int result;
+        bool overdue;
+        if (atomic_load_explicit(&tree->context->combining, memory_order_relaxed)) {
+            CombinedOp op = { .create = true, .path = path, .components = &components,
+                              .name = to_insert,
+                              .top = components.count - 1 - first_to_release.level };
+            combine(&first_to_release, &op);
+            result = op.result;
+            overdue = op.overdue;
+        } else {
+            upgrade_to_writer(&first_to_release, path, &components, components.count - 1);
+            if (!first_to_release.tree) return ENOENT;
+            result = create_in_chain(first_to_release.folder, first_to_release.level,
+                                     path, to_insert);
+            overdue = filter_overdue(top);
+        }
+        release_readers_and_writer(first_to_release);
+        if (overdue) rebuild_filter(tree, path, &components);
+        return result;
+    }
 
-    Tree* new_tree = tree_new();
-    new_tree->parent = folder_parent;
-    hmap_insert(folder_parent->subTrees, to_insert, new_tree);
+    Tree* new_tree = node_new(folder_parent, folder_parent->context);
+    if (!new_tree) {
+        release_readers_and_writer(first_to_release);
+        return ENOMEM;
+    }
+    if (!top) filter_attach(new_tree);
+    if (!smap_insert(folder_parent->subTrees, to_insert, new_tree)) {
+        node_free(new_tree);
+        // Someone created it in the meantime, or the arena is full.
+        int result = smap_get(folder_parent->subTrees, to_insert) ? EEXIST : ENOMEM;
+        release_readers_and_writer(first_to_release);
+        return result;
+    }
+    add_descendants(folder_parent, NULL, 1);
+    publish_event(folder_parent, NULL, NULL, TREE_EVENT_CREATE, path, NULL);
+    bool overdue = filter_overdue(top);
     release_readers_and_writer(first_to_release);
+    if (overdue) rebuild_filter(tree, path, &components);
 
     return 0;
 }
 
-int tree_remove(Tree* tree, const char* path) {
-    if (!is_path_valid(path)) return EINVAL;
-    if (strlen(path) == 1) return EBUSY;
+// Return a new node for the folder at `depth` of the parsed path, with
+// all the following folders in its chain, whose parent is `parent`,
+// or NULL if the arena is full. No one else can see it yet.
+static Tree* chain_new(Tree* parent, const char* path, const PathComponents* components,
+                       size_t depth) {
+    Tree* node = node_new(parent, parent->context);
+    if (!node) return NULL;
+    size_t from = components->slash[depth + 1];
+    if (!join_chain(parent->context->arena, NULL, path + from,
+                    components->slash[components->count] - from + 1, NULL, &node->chain)) {
+        node_free(node);
+        return NULL;
+    }
+    node->chain_length = components->count - 1 - depth;
+    return node;
+}
+
+// Publish a create event for every folder from `depth` of the path,
+// created at once in `parent`. All but the first are in the chain of `created`.
+static void publish_chain(Tree* parent, Tree* created, const char* path,
+                          const PathComponents* components, size_t depth) {
+    char folder[MAX_PATH_LENGTH + 1];
+    for (size_t i = depth; i < components->count; ++i) {
+        size_t len = components->slash[i + 1] + 1;
+        memcpy(folder, path, len);
+        folder[len] = '\0';
+        publish_event(i == depth ? parent : created, NULL, NULL, TREE_EVENT_CREATE,
+                      folder, NULL);
+    }
+}
 
+// Create the missing folders of the path below `node`, whose first folder
+// is at depth `top`, like create_in_chain does for one folder.
+// The caller holds a writer in node or above it.
+static int create_all_below(Tree* node, size_t top, const char* path,
+                            const PathComponents* components) {
     char component[MAX_FOLDER_NAME_LENGTH + 1];
-    char* subpath = make_path_to_parent(path, component);
-    PairTB first_to_release = let_readers_and_writer_in(tree, subpath, true);
-    if (!first_to_release.tree) {
-        free(subpath);
-        return ENOENT;
+    for (;;) {
+        size_t level = follow_chain(node, top, path, components, components->count);
+        size_t depth = top + level;
+        if (depth == components->count) return EEXIST;
+        if (level < node->chain_length && !split_chain(node, level)) return ENOMEM;
+
+        size_t created = components->count - depth;
+        if (smap_size(node->subTrees) == 0 && node->parent && !has_watches(node)) {
+            filter_add_path(top_node(node), path, components, depth + 1, components->count);
+            size_t from = components->slash[depth];
+            if (!extend_chain(node, path + from,
+                              components->slash[components->count] - from + 1, created))
+                return ENOMEM;
+            add_descendants(node->parent, NULL, created);
+            publish_chain(node, node, path, components, depth);
+            return 0;
+        }
+        path_component(path, components, depth, component);
+        Tree* next = (Tree*)smap_get(node->subTrees, component);
+        if (!next) {
+            filter_add_path(top_node(node), path, components, depth + 1, components->count);
+            Tree* chain = chain_new(node, path, components, depth);
+            if (!chain || !smap_insert(node->subTrees, component, chain)) {
+                if (chain) node_free(chain);
+                merge_chain(node); // Undo the split, if there was one.
+                return ENOMEM;
+            }
+            add_descendants(node, NULL, created);
+            publish_chain(node, chain, path, components, depth);
+            return 0;
+        }
+        node = next;
+        top = depth + 1;
     }
+}
 
-    Tree* folder_parent = find_path_subtree(tree, subpath);
-    free(subpath);
+static int create_all_folders(Tree* tree, const char* path) {
+    PathComponents components;
+    if (!parse_path(path, &components)) return EINVAL;
+    if (components.count == 0) return EEXIST;
+    if (!tree) return ENOENT;
 
-    if (!folder_parent || !hmap_get(folder_parent->subTrees, component)) {
-        release_readers_and_writer(first_to_release);
-        return ENOENT;
+    // Descend under readers as long as folders exist. At the first missing
+    // one insert the whole missing chain at once, unless someone was
+    // faster, then keep descending. If a chain has to be split or extended,
+    // a writer is taken instead and the rest is done below it.
+    char component[MAX_FOLDER_NAME_LENGTH + 1];
+    Tree* current = tree;
+    size_t top = 0;
+    int result = EEXIST;
+    rw_reader_preliminary_protocol(current->library);
+    for (;;) {
+        size_t level = follow_chain(current, top, path, &components, components.count);
+        size_t depth = top + level;
+        if (depth == components.count) break;
+        if (level < current->chain_length
+            || (smap_size(current->subTrees) == 0 && current->parent)) {
+            rw_reader_final_protocol(current->library);
+            rw_writer_preliminary_protocol(current->library);
+            PairTB first_to_release = { current, true, current, 0 };
+            result = create_all_below(current, top, path, &components);
+            bool overdue = filter_overdue(top_node(current));
+            release_readers_and_writer(first_to_release);
+            if (overdue) rebuild_filter(tree, path, &components);
+            return result;
+        }
+
+        path_component(path, &components, depth, component);
+        Tree* next = (Tree*)smap_get(current->subTrees, component);
+        if (!next) {
+            Tree* chain = chain_new(current, path, &components, depth);
+            if (!chain) {
+                result = ENOMEM;
+                break;
+            }
+            Tree* top_of_chain = top_node(current);
+            if (top_of_chain)
+                filter_add_path(top_of_chain, path, &components, depth + 1, components.count);
+            else
+                filter_attach(chain);
+            if (smap_insert(current->subTrees, component, chain)) {
+                add_descendants(current, NULL, components.count - depth);
+                publish_chain(current, chain, path, &components, depth);
+                bool overdue = filter_overdue(top_of_chain);
+                PairTB first_to_release = { current, false, current, 0 };
+                release_readers_and_writer(first_to_release);
+                if (overdue) rebuild_filter(tree, path, &components);
+                return 0;
+            }
+            node_free(chain);
+            // It cannot be removed again, that needs a writer in current.
+            next = (Tree*)smap_get(current->subTrees, component);
+            if (!next) {
+                result = ENOMEM; // The arena is full.
+                break;
+            }
+        }
+        rw_reader_preliminary_protocol(next->library);
+        current = next;
+        top = depth + 1;
     }
 
-    Tree* to_remove = (Tree*)hmap_get(folder_parent->subTrees, component);
-    if (hmap_size(to_remove->subTrees) != 0) {
-        release_readers_and_writer(first_to_release);
-        return ENOTEMPTY;
+    PairTB first_to_release = { current, false, current, 0 };
+    release_readers_and_writer(first_to_release);
+    return result;
+}
+
+static int remove_folder(Tree* tree, const char* path) {
+    PathComponents components;
+    if (!parse_path(path, &components)) return EINVAL;
+    if (components.count == 0) return EBUSY;
+
+    char component[MAX_FOLDER_NAME_LENGTH + 1];
+    path_component(path, &components, components.count - 1, component);
+    // Combined removes publish under a reader, others take the writer at once.
+    bool combining = tree && atomic_load_explicit(&tree->context->combining,
+                                                  memory_order_relaxed);
+    PairTB first_to_release =
+        let_readers_and_writer_in(tree, path, &components, components.count - 1, !combining);
+    if (!first_to_release.tree) return ENOENT;
+
+    int result;
+    bool overdue;
+    if (combining) {
+        CombinedOp op = { .create = false, .path = path, .components = &components,
+                          .name = component,
+                          .top = components.count - 1 - first_to_release.level };
+        combine(&first_to_release, &op);
+        result = op.result;
+        overdue = op.overdue;
+    } else {
+        Tree* folder_parent = first_to_release.folder;
+        result = remove_in_chain(folder_parent, first_to_release.level, path, component);
+        overdue = filter_overdue(top_node(folder_parent));
     }
-    tree_free(to_remove);
-    hmap_remove(folder_parent->subTrees, component);
     release_readers_and_writer(first_to_release);
+    if (overdue) rebuild_filter(tree, path, &components);
 
-    return 0;
+    return result;
 }
 
-int tree_move(Tree* tree, const char* source, const char* target) {
-    if (!is_path_valid(source) || !is_path_valid(target)) return EINVAL;
-    if (strlen(source) == 1) return EBUSY;
-    if (strlen(target) == 1) return EEXIST;
+// Return the node holding the parent of the folder the parsed path leads
+// to and save its level. It is searched from lca, the node holding the
+// folder at depth lca_depth, whose first folder is at depth lca_top, if it
+// lies below it, and from the root otherwise (when one path is a prefix of the other).
+static Tree* find_parent(Tree* tree, Tree* lca, size_t lca_top, size_t lca_depth,
+                         const char* path, const PathComponents* components, size_t* level) {
+    if (components->count - 1 < lca_depth)
+        return find_folder(tree, 0, path, components, components->count - 1, level);
+    return find_folder(lca, lca_top, path, components, components->count - 1, level);
+}
+
+// Merge back chains of both parents of a move that failed for lack of
+// memory. Merging a node can free its only subfolder, so if one parent
+// lies below the other, it goes first.
+// The caller holds a writer above both.
+static void undo_splits(Tree* source_parent, Tree* target_parent) {
+    for (Tree* t = source_parent; t; t = t->parent) {
+        if (t == target_parent) {
+            merge_chain(source_parent);
+            merge_chain(target_parent);
+            return;
+        }
+    }
+    merge_chain(target_parent);
+    merge_chain(source_parent);
+}
+
+static int move_folder(Tree* tree, const char* source, const char* target) {
+    PathComponents source_components, target_components;
+    if (!parse_path(source, &source_components) || !parse_path(target, &target_components))
+        return EINVAL;
+    if (source_components.count == 0) return EBUSY;
+    if (target_components.count == 0) return EEXIST;
     if (moving_to_subtree(source, target)) return NEW_ERROR;
 
-    char* lca = path_to_lca(source, target);
-    PairTB first_to_release = let_readers_and_writer_in(tree, lca, true);
-    free(lca);
+    size_t lca_depth = common_components(source, &source_components,
+                                         target, &target_components);
+    PairTB first_to_release =
+        let_readers_and_writer_in(tree, source, &source_components, lca_depth, true);
     if (!first_to_release.tree) return ENOENT;
+    // Everything below the writer is frozen, so chains there can be split freely.
+    Tree* lca = first_to_release.folder;
+    size_t lca_top = lca_depth - first_to_release.level;
 
     char source_name[MAX_FOLDER_NAME_LENGTH + 1];
-    char* source_parent = make_path_to_parent(source, source_name);
-    Tree* source_parent_tree = find_path_subtree(tree, source_parent);
-    free(source_parent);
-
-    if (!source_parent_tree || !hmap_get(source_parent_tree->subTrees, source_name)) {
+    path_component(source, &source_components, source_components.count - 1, source_name);
+    size_t source_level;
+    Tree* source_parent_tree = find_parent(tree, lca, lca_top, lca_depth,
+                                           source, &source_components, &source_level);
+    if (!source_parent_tree || !has_child(source_parent_tree, source_level, source_name)) {
         release_readers_and_writer(first_to_release);
         return ENOENT;
     }
 
-    Tree* to_move = (Tree*)hmap_get(source_parent_tree->subTrees, source_name);
-
     char target_name[MAX_FOLDER_NAME_LENGTH + 1];
-    char* target_parent = make_path_to_parent(target, target_name);
-    Tree* target_tree = find_path_subtree(tree, target_parent);
-    free(target_parent);
+    path_component(target, &target_components, target_components.count - 1, target_name);
+    size_t target_level;
+    Tree* target_tree = find_parent(tree, lca, lca_top, lca_depth,
+                                    target, &target_components, &target_level);
 
     if (!target_tree) {
         release_readers_and_writer(first_to_release);
@@ -243,15 +1304,665 @@ int tree_move(Tree* tree, const char* source, const char* target) {
         release_readers_and_writer(first_to_release);
         return 0;
     }
-    if (hmap_get(target_tree->subTrees, target_name)) {
+    if (has_child(target_tree, target_level, target_name)) {
         release_readers_and_writer(first_to_release);
         return EEXIST;
     }
 
-    hmap_remove(source_parent_tree->subTrees, source_name);
+    // Make both parents last folders of their chains, so the source is
+    // a node of its own. Each split can move the other parent to a new node.
+    if (source_level < source_parent_tree->chain_length
+        && !split_chain(source_parent_tree, source_level)) {
+        release_readers_and_writer(first_to_release);
+        return ENOMEM;
+    }
+    Tree* to_move = (Tree*)smap_get(source_parent_tree->subTrees, source_name);
+    target_tree = find_parent(tree, lca, lca_top, lca_depth,
+                              target, &target_components, &target_level);
+    // The target gets the folder before the source loses it, so the only
+    // steps that can fail come before any visible change.
+    if ((target_level < target_tree->chain_length && !split_chain(target_tree, target_level))
+        || !smap_insert(target_tree->subTrees, target_name, to_move)) {
+        undo_splits(to_move->parent, target_tree);
+        release_readers_and_writer(first_to_release);
+        return ENOMEM;
+    }
+    source_parent_tree = to_move->parent;
+    Tree* source_top = top_node(to_move);
+    size_t lca_level;
+    lca = find_folder(lca, lca_top, source, &source_components, lca_depth, &lca_level);
+
+    smap_remove(source_parent_tree->subTrees, source_name);
     to_move->parent = target_tree;
-    hmap_insert(target_tree->subTrees, target_name, to_move);
+    // Counts in lca and above do not change, everything below lca is
+    // frozen by the writer there.
+    size_t moved = 1 + to_move->chain_length
+        + atomic_load_explicit(&to_move->descendants, memory_order_relaxed);
+    add_descendants(source_parent_tree, lca, -moved);
+    add_descendants(target_tree, lca, moved);
+    // Keys of the moved folders are relative to the child of the root
+    // above them, they stay valid only if that is the moved folder itself.
+    Tree* target_top = top_node(to_move);
+    if (source_top != to_move) filter_forget(source_top, moved);
+    if (target_top == to_move) {
+        if (source_top != to_move) filter_attach(to_move);
+    } else {
+        if (to_move->filter) {
+            bloom_free(to_move->filter);
+            to_move->filter = NULL;
+        }
+        if (target_top->filter) {
+            uint64_t key = folder_key(target, &target_components, target_components.count);
+            bloom_add(target_top->filter, key);
+            filter_add_below(target_top->filter, to_move, key);
+        }
+    }
+    bool source_overdue = source_top != to_move && filter_overdue(source_top);
+    bool target_overdue = target_top != to_move && filter_overdue(target_top);
+    publish_event(source_parent_tree, target_tree, lca,
+                  TREE_EVENT_MOVE, source, target);
+    // Either parent can be left with a single subfolder. The target goes
+    // first, merging the source parent can free it.
+    merge_chain(target_tree);
+    merge_chain(source_parent_tree);
+    release_readers_and_writer(first_to_release);
+    if (source_overdue) rebuild_filter(tree, source, &source_components);
+    if (target_overdue) rebuild_filter(tree, target, &target_components);
+
+    return 0;
+}
+
+// A node of a snapshot taken by tree_copy. Entries are in preorder, the
+// subtree of an entry is `size` entries starting with it.
+// name and chain are offsets into the strings of the snapshot.
+typedef struct SnapshotNode {
+    size_t name; // Key in the parent, empty for the first entry.
+    size_t chain; // SIZE_MAX if the node has no chain.
+    size_t chain_length;
+    size_t descendants;
+    size_t size;
+} SnapshotNode;
+
+typedef struct Snapshot {
+    SnapshotNode* nodes;
+    size_t count;
+    size_t capacity;
+    char* strings;
+    size_t strings_length;
+    size_t strings_capacity;
+} Snapshot;
+
+// Append `len` bytes of `string` and '\0' to the strings of the snapshot
+// and return the offset of the copy.
+static size_t snapshot_string(Snapshot* snapshot, const char* string, size_t len) {
+    while (snapshot->strings_length + len + 1 > snapshot->strings_capacity) {
+        snapshot->strings_capacity = 2 * snapshot->strings_capacity + 64;
+        snapshot->strings = realloc(snapshot->strings, snapshot->strings_capacity);
+        CHECK_PTR(snapshot->strings);
+    }
+    size_t offset = snapshot->strings_length;
+    memcpy(snapshot->strings + offset, string, len);
+    snapshot->strings[offset + len] = '\0';
+    snapshot->strings_length += len + 1;
+    return offset;
+}
+
+// Append `node` and everything below it to the snapshot, with `chain`,
+// a suffix of its chain or NULL, and `chain_length` instead of its own.
+// The caller makes sure nothing below node changes.
+static void snapshot_take(Snapshot* snapshot, Tree* node, const char* name,
+                          const char* chain, size_t chain_length) {
+    if (snapshot->count == snapshot->capacity) {
+        snapshot->capacity = 2 * snapshot->capacity + 16;
+        snapshot->nodes = realloc(snapshot->nodes, snapshot->capacity * sizeof(SnapshotNode));
+        CHECK_PTR(snapshot->nodes);
+    }
+    size_t index = snapshot->count++;
+    snapshot->nodes[index].name = snapshot_string(snapshot, name, strlen(name));
+    snapshot->nodes[index].chain = chain && chain[1]
+        ? snapshot_string(snapshot, chain, strlen(chain)) : SIZE_MAX;
+    snapshot->nodes[index].chain_length = chain_length;
+    snapshot->nodes[index].descendants =
+        atomic_load_explicit(&node->descendants, memory_order_relaxed);
+
+    const char* key;
+    void* value;
+    StripedMapIterator it = smap_iterator_after(node->subTrees, NULL);
+    while (smap_next(node->subTrees, &it, &key, &value)) {
+        Tree* child = (Tree*)value;
+        snapshot_take(snapshot, child, key, child->chain, child->chain_length);
+    }
+    snapshot->nodes[index].size = snapshot->count - index;
+}
+
+// Return a new node with the chain and counts of entry `index` of the
+// snapshot, without subfolders, or NULL if the arena is full.
+static Tree* clone_one(const Snapshot* snapshot, size_t index, Tree* parent,
+                       TreeContext* context) {
+    const SnapshotNode* entry = &snapshot->nodes[index];
+    Tree* node = node_new(parent, context);
+    if (!node) return NULL;
+    if (entry->chain != SIZE_MAX) {
+        const char* chain = snapshot->strings + entry->chain;
+        if (!join_chain(context->arena, NULL, chain, strlen(chain), NULL, &node->chain)) {
+            node_free(node);
+            return NULL;
+        }
+    }
+    node->chain_length = entry->chain_length;
+    atomic_store_explicit(&node->descendants, entry->descendants, memory_order_relaxed);
+    return node;
+}
+
+// Insert `child`, a copy of entry `index` of the snapshot, into `parent`.
+// If it is NULL or the arena is full, free it and return false.
+static bool clone_insert(const Snapshot* snapshot, size_t index, Tree* parent, Tree* child) {
+    if (child && smap_insert(parent->subTrees, snapshot->strings + snapshot->nodes[index].name,
+                             child))
+        return true;
+    if (child) node_free(child);
+    return false;
+}
+
+// Return a new node built from entry `index` of the snapshot, with
+// copies of everything below it, or NULL if the arena is full.
+// No one else can see it yet.
+static Tree* clone_node(const Snapshot* snapshot, size_t index, Tree* parent,
+                        TreeContext* context) {
+    Tree* node = clone_one(snapshot, index, parent, context);
+    if (!node) return NULL;
+    size_t end = index + snapshot->nodes[index].size;
+    for (size_t child = index + 1; child < end; child += snapshot->nodes[child].size) {
+        if (!clone_insert(snapshot, child, node, clone_node(snapshot, child, node, context))) {
+            node_free(node);
+            return NULL;
+        }
+    }
+    return node;
+}
+
+// Subtree of the snapshot to be copied by a worker into `parent`.
+typedef struct CloneTask {
+    size_t index;
+    Tree* parent;
+} CloneTask;
+
+typedef struct CloneJob {
+    const Snapshot* snapshot;
+    TreeContext* context;
+    CloneTask* tasks;
+    size_t count;
+    atomic_size_t next; // First task not taken by any worker.
+    atomic_bool failed; // Set if the arena got full, the copy is then dropped.
+} CloneJob;
+
+// Copy subtrees of the job until none is left. Inserts into the same
+// parent can run on several workers, the map locks its stripes itself.
+static void* clone_worker(void* data) {
+    CloneJob* job = data;
+    size_t t;
+    while ((t = atomic_fetch_add_explicit(&job->next, 1, memory_order_relaxed)) < job->count) {
+        CloneTask* task = &job->tasks[t];
+        if (atomic_load_explicit(&job->failed, memory_order_relaxed)) break;
+        if (!clone_insert(job->snapshot, task->index, task->parent,
+                          clone_node(job->snapshot, task->index, task->parent, job->context)))
+            atomic_store_explicit(&job->failed, true, memory_order_relaxed);
+    }
+    return NULL;
+}
+
+// Like clone_node, but subtrees of at most `limit` entries are left
+// to workers as tasks of the job. If it returns NULL, the tasks point
+// to freed nodes and must not be run.
+static Tree* clone_top(const Snapshot* snapshot, size_t index, Tree* parent,
+                       TreeContext* context, size_t limit, CloneJob* job) {
+    Tree* node = clone_one(snapshot, index, parent, context);
+    if (!node) return NULL;
+    size_t end = index + snapshot->nodes[index].size;
+    for (size_t child = index + 1; child < end; child += snapshot->nodes[child].size) {
+        if (snapshot->nodes[child].size <= limit) {
+            job->tasks[job->count++] = (CloneTask){ child, node };
+        } else if (!clone_insert(snapshot, child, node,
+                                 clone_top(snapshot, child, node, context, limit, job))) {
+            node_free(node);
+            return NULL;
+        }
+    }
+    return node;
+}
+
+// Return a copy of the whole snapshot, without a parent, or NULL if the
+// arena is full. Big snapshots are cut into many subtrees, so threads
+// that finish early take more of them.
+static Tree* clone_snapshot(const Snapshot* snapshot, TreeContext* context) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t threads = cpus < 1 ? 1 : cpus > COPY_MAX_THREADS ? COPY_MAX_THREADS : cpus;
+    if (threads == 1 || snapshot->count < COPY_PARALLEL_MIN)
+        return clone_node(snapshot, 0, NULL, context);
+
+    CloneJob job;
+    job.snapshot = snapshot;
+    job.context = context;
+    job.tasks = malloc(snapshot->count * sizeof(CloneTask));
+    CHECK_PTR(job.tasks);
+    job.count = 0;
+    atomic_init(&job.next, 0);
+    atomic_init(&job.failed, false);
+    Tree* copy = clone_top(snapshot, 0, NULL, context, snapshot->count / (8 * threads), &job);
+    if (!copy) {
+        free(job.tasks);
+        return NULL;
+    }
+
+    pthread_t workers[COPY_MAX_THREADS];
+    for (size_t i = 1; i < threads; ++i)
+        CHECK(pthread_create(&workers[i], NULL, clone_worker, &job));
+    clone_worker(&job);
+    for (size_t i = 1; i < threads; ++i)
+        CHECK(pthread_join(workers[i], NULL));
+    free(job.tasks);
+    if (atomic_load_explicit(&job.failed, memory_order_relaxed)) {
+        node_free(copy);
+        return NULL;
+    }
+    return copy;
+}
+
+// Return ENOENT if the parent of the target does not exist, EEXIST if the
+// target does, or 0. Used to fail before building a copy for nothing.
+static int check_target(Tree* tree, const char* target, const PathComponents* components) {
+    char name[MAX_FOLDER_NAME_LENGTH + 1];
+    path_component(target, components, components->count - 1, name);
+    PairTB first_to_release =
+        let_readers_and_writer_in(tree, target, components, components->count - 1, false);
+    if (!first_to_release.tree) return ENOENT;
+    int result = has_child(first_to_release.folder, first_to_release.level, name) ? EEXIST : 0;
+    release_readers_and_writer(first_to_release);
+    return result;
+}
+
+static int copy_folder(Tree* tree, const char* source, const char* target) {
+    PathComponents source_components, target_components;
+    if (!parse_path(source, &source_components) || !parse_path(target, &target_components))
+        return EINVAL;
+    if (source_components.count == 0) return EBUSY;
+    if (target_components.count == 0) return EEXIST;
+    if (moving_to_subtree(source, target)) return NEW_ERROR;
+
+    // Creates need only readers, so the snapshot takes a writer in the
+    // source to see the subtree at one moment. It is only read, the copy
+    // is built after everything is released.
+    PairTB first_to_release = let_readers_and_writer_in(tree, source, &source_components,
+                                                        source_components.count, true);
+    if (!first_to_release.tree) return ENOENT;
+    Tree* folder = first_to_release.folder;
+    size_t level = first_to_release.level;
+    Snapshot snapshot = { NULL, 0, 0, NULL, 0, 0 };
+    snapshot_take(&snapshot, folder, "", folder->chain ? chain_slash(folder->chain, level) : NULL,
+                  folder->chain_length - level);
+    release_readers_and_writer(first_to_release);
+
+    int result = check_target(tree, target, &target_components);
+    if (result != 0) {
+        free(snapshot.nodes);
+        free(snapshot.strings);
+        return result;
+    }
+    Tree* copy = clone_snapshot(&snapshot, tree->context);
+    free(snapshot.nodes);
+    free(snapshot.strings);
+    if (!copy) return ENOMEM;
+
+    char target_name[MAX_FOLDER_NAME_LENGTH + 1];
+    path_component(target, &target_components, target_components.count - 1, target_name);
+    first_to_release = let_readers_and_writer_in(tree, target, &target_components,
+                                                 target_components.count - 1, true);
+    if (!first_to_release.tree) {
+        result = ENOENT;
+    } else if (has_child(first_to_release.folder, first_to_release.level, target_name)) {
+        result = EEXIST;
+    }
+    if (result != 0) {
+        release_readers_and_writer(first_to_release);
+        node_free(copy);
+        return result;
+    }
+
+    Tree* target_tree = first_to_release.folder;
+    bool split = first_to_release.level < target_tree->chain_length;
+    if ((split && !split_chain(target_tree, first_to_release.level))
+        || !smap_insert(target_tree->subTrees, target_name, copy)) {
+        if (split) merge_chain(target_tree);
+        release_readers_and_writer(first_to_release);
+        node_free(copy);
+        return ENOMEM;
+    }
+    // No one sees the copy before the writer in the parent is released.
+    copy->parent = target_tree;
+    Tree* top = top_node(target_tree);
+    if (!top) {
+        filter_attach(copy);
+    } else if (top->filter) {
+        uint64_t key = folder_key(target, &target_components, target_components.count);
+        bloom_add(top->filter, key);
+        filter_add_below(top->filter, copy, key);
+    }
+    add_descendants(target_tree, NULL, 1 + copy->chain_length
+                    + atomic_load_explicit(&copy->descendants, memory_order_relaxed));
+    publish_event(target_tree, NULL, NULL, TREE_EVENT_CREATE, target, NULL);
+    merge_chain(target_tree);
+    bool overdue = filter_overdue(top);
     release_readers_and_writer(first_to_release);
+    if (overdue) rebuild_filter(tree, target, &target_components);
 
     return 0;
 }
+
+int tree_stat(Tree* tree, const char* path, TreeStat* info) {
+    PathComponents components;
+    if (!parse_path(path, &components)) return EINVAL;
+    PairTB first_to_release =
+        let_readers_and_writer_in(tree, path, &components, components.count, false);
+    if (!first_to_release.tree) return ENOENT;
+
+    // Folders of the chain below this one each have one subfolder.
+    Tree* folder = first_to_release.folder;
+    size_t below = folder->chain_length - first_to_release.level;
+    info->children = below ? 1 : smap_size(folder->subTrees);
+    info->descendants =
+        below + atomic_load_explicit(&folder->descendants, memory_order_relaxed);
+    info->depth = components.count;
+
+    release_readers_and_writer(first_to_release);
+    return 0;
+}
+
+// Return the recorder of the tree or NULL if operations are not logged.
+static TraceRecorder* get_recorder(Tree* tree) {
+    if (!tree) return NULL;
+    return atomic_load_explicit(&tree->context->recorder, memory_order_acquire);
+}
+
+char* tree_list(Tree* tree, const char* path) {
+    TraceRecorder* recorder = get_recorder(tree);
+    if (!recorder) return list_folder(tree, path, NULL, SIZE_MAX);
+
+    uint64_t start = trace_now();
+    char* result = list_folder(tree, path, NULL, SIZE_MAX);
+    trace_record(recorder, TRACE_OP_LIST, path, NULL, 0, start, result ? 0 : -1);
+    return result;
+}
+
+char* tree_list_range(Tree* tree, const char* path, const char* after_name, size_t limit) {
+    TraceRecorder* recorder = get_recorder(tree);
+    if (!recorder) return list_folder(tree, path, after_name, limit);
+
+    uint64_t start = trace_now();
+    char* result = list_folder(tree, path, after_name, limit);
+    uint32_t recorded_limit = limit > UINT32_MAX ? UINT32_MAX : limit;
+    trace_record(recorder, TRACE_OP_LIST_RANGE, path, after_name, recorded_limit,
+                 start, result ? 0 : -1);
+    return result;
+}
+
+// Both variants below are logged as TRACE_OP_LIST, they do the same reading.
+int tree_list_into(Tree* tree, const char* path, char* buffer, size_t capacity,
+                   size_t* needed) {
+    TraceRecorder* recorder = get_recorder(tree);
+    if (!recorder) return list_folder_into(tree, path, buffer, capacity, needed);
+
+    uint64_t start = trace_now();
+    int result = list_folder_into(tree, path, buffer, capacity, needed);
+    trace_record(recorder, TRACE_OP_LIST, path, NULL, 0, start,
+                 result == 0 || result == ERANGE ? 0 : -1);
+    return result;
+}
+
+int tree_list_each(Tree* tree, const char* path, TreeListCallback callback, void* arg) {
+    TraceRecorder* recorder = get_recorder(tree);
+    if (!recorder) return list_folder_each(tree, path, callback, arg);
+
+    uint64_t start = trace_now();
+    int result = list_folder_each(tree, path, callback, arg);
+    trace_record(recorder, TRACE_OP_LIST, path, NULL, 0, start, result == 0 ? 0 : -1);
+    return result;
+}
+
+int tree_create(Tree* tree, const char* path) {
+    TraceRecorder* recorder = get_recorder(tree);
+    if (!recorder) return create_folder(tree, path);
+
+    uint64_t start = trace_now();
+    int result = create_folder(tree, path);
+    trace_record(recorder, TRACE_OP_CREATE, path, NULL, 0, start, result);
+    return result;
+}
+
+int tree_create_all(Tree* tree, const char* path) {
+    TraceRecorder* recorder = get_recorder(tree);
+    if (!recorder) return create_all_folders(tree, path);
+
+    uint64_t start = trace_now();
+    int result = create_all_folders(tree, path);
+    trace_record(recorder, TRACE_OP_CREATE_ALL, path, NULL, 0, start, result);
+    return result;
+}
+
+int tree_remove(Tree* tree, const char* path) {
+    TraceRecorder* recorder = get_recorder(tree);
+    if (!recorder) return remove_folder(tree, path);
+
+    uint64_t start = trace_now();
+    int result = remove_folder(tree, path);
+    trace_record(recorder, TRACE_OP_REMOVE, path, NULL, 0, start, result);
+    return result;
+}
+
+int tree_move(Tree* tree, const char* source, const char* target) {
+    TraceRecorder* recorder = get_recorder(tree);
+    if (!recorder) return move_folder(tree, source, target);
+
+    uint64_t start = trace_now();
+    int result = move_folder(tree, source, target);
+    trace_record(recorder, TRACE_OP_MOVE, source, target, 0, start, result);
+    return result;
+}
+
+int tree_copy(Tree* tree, const char* source, const char* target) {
+    TraceRecorder* recorder = get_recorder(tree);
+    if (!recorder) return copy_folder(tree, source, target);
+
+    uint64_t start = trace_now();
+    int result = copy_folder(tree, source, target);
+    trace_record(recorder, TRACE_OP_COPY, source, target, 0, start, result);
+    return result;
+}
+
+// Log every folder below `tree` as a setup record.
+// `path` is a buffer holding the path of `tree`, of length `len`.
+static void record_snapshot(Tree* tree, char* path, size_t len, TraceRecorder* recorder) {
+    rw_reader_preliminary_protocol(tree->library);
+    // Folders of the chain, each one inside the previous.
+    for (const char* c = tree->chain; c && c[1]; c = strchr(c + 1, '/')) {
+        size_t name_len = strchr(c + 1, '/') - c; // With the ending '/'.
+        memcpy(path + len, c + 1, name_len);
+        len += name_len;
+        path[len] = '\0';
+        trace_record(recorder, TRACE_OP_SETUP, path, NULL, 0, trace_now(), 0);
+    }
+    const char* key;
+    void* value;
+    smap_lock_all(tree->subTrees);
+    StripedMapIterator it = smap_iterator_after(tree->subTrees, NULL);
+    while (smap_next(tree->subTrees, &it, &key, &value)) {
+        size_t key_len = strlen(key);
+        memcpy(path + len, key, key_len);
+        path[len + key_len] = '/';
+        path[len + key_len + 1] = '\0';
+        trace_record(recorder, TRACE_OP_SETUP, path, NULL, 0, trace_now(), 0);
+        record_snapshot((Tree*)value, path, len + key_len + 1, recorder);
+    }
+    smap_unlock_all(tree->subTrees);
+    rw_reader_final_protocol(tree->library);
+}
+
+void tree_set_recorder(Tree* tree, TraceRecorder* recorder) {
+    // The recorder exists only in this process.
+    if (tree->context->arena) return;
+    if (recorder) {
+        char path[MAX_PATH_LENGTH + 1] = "/";
+        record_snapshot(tree, path, 1, recorder);
+    }
+    atomic_store_explicit(&tree->context->recorder, recorder, memory_order_release);
+}
+
+void tree_set_filters(Tree* tree, bool enabled) {
+    // The writer in the root stops every other operation.
+    rw_writer_preliminary_protocol(tree->library);
+    if (tree->context->filters != enabled) {
+        tree->context->filters = enabled;
+        const char* key;
+        void* value;
+        StripedMapIterator it = smap_iterator_after(tree->subTrees, NULL);
+        while (smap_next(tree->subTrees, &it, &key, &value)) {
+            Tree* child = (Tree*)value;
+            if (child->filter) bloom_free(child->filter);
+            child->filter = NULL;
+            filter_attach(child);
+        }
+    }
+    rw_writer_final_protocol(tree->library);
+}
+
+void tree_set_combining(Tree* tree, bool enabled) {
+    // Published operations live on stacks of their threads,
+    // which other processes cannot reach.
+    if (tree->context->arena) return;
+    atomic_store_explicit(&tree->context->combining, enabled, memory_order_relaxed);
+}
+
+// A folder waiting to be added to an image: its node, its place in the
+// chain and its name.
+typedef struct ImageQueued {
+    Tree* node;
+    size_t level;
+    const char* name;
+    size_t name_length;
+} ImageQueued;
+
+TreeImage* tree_freeze(Tree* tree) {
+    // The writer in the root stops every other operation,
+    // so the image shows the tree at one moment.
+    rw_writer_preliminary_protocol(tree->library);
+    size_t count = 1 + atomic_load_explicit(&tree->descendants, memory_order_relaxed);
+    TreeImage* image = image_new(count, atomic_load_explicit(&tree->context->generation,
+                                                             memory_order_relaxed));
+    // Folders are queued in breadth-first order, the queue is that order.
+    ImageQueued* queue = malloc(count * sizeof(ImageQueued));
+    CHECK_PTR(queue);
+    queue[0] = (ImageQueued){ tree, 0, "", 0 };
+    size_t end = 1;
+    for (size_t i = 0; i < count; ++i) {
+        Tree* node = queue[i].node;
+        size_t level = queue[i].level;
+        size_t children, descendants;
+        // The queue is sized by the descendant count of the root.
+        if (level < node->chain_length) {
+            const char* name = chain_slash(node->chain, level) + 1;
+            assert(end < count);
+            queue[end++] = (ImageQueued){ node, level + 1, name, strchr(name, '/') - name };
+            children = 1;
+            descendants = node->chain_length - level
+                + atomic_load_explicit(&node->descendants, memory_order_relaxed);
+        } else {
+            const char* key;
+            void* value;
+            StripedMapIterator it = smap_iterator_after(node->subTrees, NULL);
+            while (smap_next(node->subTrees, &it, &key, &value)) {
+                assert(end < count);
+                queue[end++] = (ImageQueued){ (Tree*)value, 0, key, strlen(key) };
+            }
+            children = smap_size(node->subTrees);
+            descendants = atomic_load_explicit(&node->descendants, memory_order_relaxed);
+        }
+        image_append(image, queue[i].name, queue[i].name_length, children, descendants);
+    }
+    rw_writer_final_protocol(tree->library);
+    free(queue);
+    return image;
+}
+
+bool tree_image_is_current(const TreeImage* image, Tree* tree) {
+    return image_generation(image)
+        == atomic_load_explicit(&tree->context->generation, memory_order_relaxed);
+}
+
+TreeWatch* tree_watch(Tree* tree, const char* path, int flags) {
+    // Watches and their events live in the memory of one process.
+    if (tree && tree->context->arena) return NULL;
+    PathComponents components;
+    if (!parse_path(path, &components)) return NULL;
+    PairTB first_to_release =
+        let_readers_and_writer_in(tree, path, &components, components.count, false);
+    if (!first_to_release.tree) return NULL;
+
+    // A watch needs a node of its own, an implicit folder is split off.
+    if (first_to_release.level < first_to_release.folder->chain_length) {
+        upgrade_to_writer(&first_to_release, path, &components, components.count);
+        if (!first_to_release.tree) return NULL;
+        Tree* node = first_to_release.folder;
+        if (first_to_release.level < node->chain_length
+            && !split_chain(node, first_to_release.level)) {
+            release_readers_and_writer(first_to_release);
+            return NULL;
+        }
+    }
+
+    // The lock in the folder keeps it from being removed while we attach.
+    Tree* folder = first_to_release.folder;
+    TreeContext* context = folder->context;
+    TreeWatch* watch = malloc(sizeof(TreeWatch));
+    CHECK_PTR(watch);
+    watch->context = context;
+    watch->folder = folder;
+    watch->flags = flags;
+    watch->events = ring_new(WATCH_RING_CAPACITY);
+
+    rw_writer_preliminary_protocol(&context->watch_library);
+    watch->next = folder->watches;
+    folder->watches = watch;
+    atomic_fetch_add_explicit(&folder->watch_count, 1, memory_order_relaxed);
+    rw_writer_final_protocol(&context->watch_library);
+
+    release_readers_and_writer(first_to_release);
+    return watch;
+}
+
+void tree_unwatch(TreeWatch* watch) {
+    if (!watch) return;
+    TreeContext* context = watch->context;
+
+    rw_writer_preliminary_protocol(&context->watch_library);
+    if (watch->folder) {
+        TreeWatch** w = &watch->folder->watches;
+        while (*w != watch)
+            w = &(*w)->next;
+        *w = watch->next;
+        atomic_fetch_sub_explicit(&watch->folder->watch_count, 1, memory_order_relaxed);
+    }
+    rw_writer_final_protocol(&context->watch_library);
+
+    TreeEvent* event;
+    while ((event = ring_pop(watch->events)))
+        free(event);
+    ring_free(watch->events);
+    free(watch);
+}
+
+TreeEvent* tree_watch_next(TreeWatch* watch) {
+    return (TreeEvent*)ring_pop(watch->events);
+}
+
+bool tree_watch_overflowed(TreeWatch* watch) {
+    return ring_overflowed(watch->events);
+}
@@ -23,18 +23,250 @@
  * poddrzewach, bo jeśli ktoś tam pisze, to w lca jest jakiś czytelnik.
  * Kiedy już wejdzie, nikt nie będzie mógł zmieniać tych poddrzew.
  * Analogicznie po operacji move wypuszczamy pisarza z lca i czytelników powyżej.
+ * Dzieci wierzchołka trzymam w mapie podzielonej na pasy (StripedMap), każdy pas
+ * ma własny mutex. Dzięki temu tree_create nie potrzebuje pisarza w rodzicu,
+ * wystarczy czytelnik i zablokowanie pasa, do którego trafia nowa nazwa, więc
+ * tworzenie różnych folderów w jednym katalogu odbywa się równolegle.
+ * Pisarza w rodzicu potrzebuje tylko tree_remove, bo musi poczekać, aż nikt
+ * nie będzie w usuwanym wierzchołku, oraz tree_move (pisarz w lca).
+ * Listowanie blokuje na chwilę wszystkie pasy i scala ich posortowane nazwy.
+ * Drzewo może też leżeć w segmencie pamięci współdzielonej (tree_new_shared,
+ * tree_attach). Segment jest mapowany pod tym samym adresem w każdym procesie,
+ * więc zwykłe wskaźniki pozostają poprawne, a czytelnie i pasy używają
+ * muteksów i zmiennych warunkowych z atrybutem PTHREAD_PROCESS_SHARED.
+ * Gdy segment się zapełni, operacje najpierw alokują wszystko, czego
+ * potrzebują, a dopiero potem zmieniają drzewo, więc kończą się ENOMEM
+ * bez żadnych zmian.
+ * Ciągi folderów, z których każdy ma tylko jedno dziecko, trzymam w jednym
+ * wierzchołku (kompresja ścieżek). Wierzchołek pamięta dalszą część ścieżki
+ * jako napis, a foldery wewnątrz niej nie mają własnych czytelni. Taki ciąg
+ * jest dzielony lub wydłużany tylko pod pisarzem w jego wierzchołku, więc
+ * operacja, która go zmienia, po dojściu czytelnikami do ostatniego
+ * wierzchołka zamienia tam czytelnika na pisarza i szuka folderu ponownie.
+ * Po tree_remove i tree_move ciągi są z powrotem scalane. Foldery z
+ * obserwatorami nie są kompresowane.
+ * Opcjonalnie (tree_set_filters) każde dziecko korzenia trzyma filtr Blooma
+ * ze ścieżkami wszystkich folderów w swoim poddrzewie. Wyszukiwanie sprawdza
+ * go zaraz po wejściu do tego dziecka, więc większość nieistniejących ścieżek
+ * jest odrzucana bez schodzenia i blokowania głębiej. Tworzone i przenoszone
+ * foldery są od razu dodawane do filtra, a usuniętych nie da się z niego
+ * wyjąć, więc filtr jest budowany od nowa (pod pisarzem w tym dziecku), gdy
+ * jest przepełniony lub zbyt wiele jego ścieżek jest nieaktualnych.
+ * tree_copy zapisuje kopiowane poddrzewo do płaskiej tablicy pod pisarzem
+ * w źródle (samo tworzenie wymaga tylko czytelników, więc czytelnicy nie
+ * zamroziliby poddrzewa), buduje kopię bez żadnych blokad na kilku wątkach
+ * i wstawia ją jednym smap_insert pod pisarzem w rodzicu celu.
+ * tree_freeze kompiluje całe drzewo do niezmiennego obrazu (TreeImage):
+ * foldery leżą w jednej tablicy w kolejności BFS, dzieci każdego folderu
+ * są obok siebie, posortowane i wyszukiwane binarnie, a ich nazwy, zapisane
+ * w tej samej kolejności i oddzielone przecinkami, są od razu listingiem
+ * rodzica. Obraz czyta się bez żadnych blokad i alokacji.
+ * Opcjonalnie (tree_set_combining) operacje potrzebujące pisarza w rodzicu
+ * (tree_remove oraz tree_create w pustym lub skompresowanym folderze)
+ * są łączone (flat combining): wątek odkłada operację na listę w
+ * wierzchołku rodzica, zwalnia w nim czytelnika i albo czeka na wynik,
+ * albo, jeśli nikt tego nie robi, sam wpuszcza pisarza i wykonuje za jednym
+ * razem wszystkie odłożone operacje. Czytelnicy powyżej trzymają wierzchołek
+ * na miejscu do końca, więc pisarz przechodzi z rąk do rąk raz na całą
+ * paczkę, a nie raz na każdą operację.
  */
 
+#include <stdbool.h>
+#include <stddef.h>
+#include "Trace.h"
+
+// Max length of path (excluding terminating null character).
+// Longer paths are rejected with EINVAL.
+#define MAX_PATH_LENGTH 4095
+
 typedef struct Tree Tree; // Let "Tree" mean the same as "struct Tree".
 
 Tree* tree_new();
 
+// Free the tree. A shared tree is destroyed for all processes,
+// the others must have called tree_detach before.
 void tree_free(Tree*);
 
+// Create an empty tree inside the shared memory segment behind `fd`
+// (from memfd_create or shm_open, already truncated to the wanted size).
+// Other processes can use the same tree after tree_attach, every
+// operation synchronizes between processes like between threads.
+// Watches and recording are not available for shared trees.
+// A process killed in the middle of an operation leaves its locks taken.
+// Once the segment is full, tree_create, tree_create_all, tree_copy and
+// tree_move return ENOMEM and leave the tree as it was, tree_remove
+// still works and frees memory for later operations.
+// Returns NULL and sets errno on failure, ENOMEM if `fd` is too small.
+Tree* tree_new_shared(int fd);
+
+// Map the tree made by tree_new_shared from `fd` into this process.
+// The segment has to be mapped at the same address in every process.
+// Returns NULL and sets errno, to EEXIST if that address is taken here.
+Tree* tree_attach(int fd);
+
+// Unmap a shared tree from this process without freeing it.
+void tree_detach(Tree* tree);
+
 char* tree_list(Tree* tree, const char* path);
 
+// Return at most `limit` names of subfolders of `path` that come after
+// `after_name` in lexicographic order, in the same format as tree_list.
+// If `after_name` is NULL the listing starts from the first name.
+// Passing the last name of a page as `after_name` returns the next page.
+// Each page takes O(log n + limit) time.
+// Returns NULL if the path is invalid or the folder does not exist.
+char* tree_list_range(Tree* tree, const char* path, const char* after_name, size_t limit);
+
+// Write the listing of `path`, in the same format as tree_list, into
+// `buffer` of size `capacity` without allocating any memory.
+// If `needed` is not NULL, the size the listing needs (including the
+// terminating null character) is saved there.
+// Returns 0, ERANGE if the buffer is too small (it then holds an empty
+// string), EINVAL if the path is invalid or ENOENT if the folder does not exist.
+int tree_list_into(Tree* tree, const char* path, char* buffer, size_t capacity,
+                   size_t* needed);
+
+// Called by tree_list_each for every subfolder name, in sorted order.
+// Return false to stop the listing.
+typedef bool (*TreeListCallback)(const char* name, void* arg);
+
+// Call `callback` with every subfolder name of `path` and `arg`,
+// without allocating any memory.
+// Names are copied out in batches of a few kilobytes and the callback runs
+// with no locks held, so it may call any tree_* function, also on this
+// folder. A folder whose names fit in one batch is listed at one moment,
+// a bigger one batch by batch: names created or removed in between may be
+// missed or included, and the listing stops if the folder itself is gone.
+// Names are valid only during the callback.
+// Returns 0, EINVAL if the path is invalid or ENOENT if the folder does not exist.
+int tree_list_each(Tree* tree, const char* path, TreeListCallback callback, void* arg);
+
 int tree_create(Tree* tree, const char* path);
 
+// Create the folder under `path` together with all missing ancestors,
+// like `mkdir -p`. The path is walked once under readers and the whole
+// missing chain is built aside and inserted into the deepest existing
+// folder at once.
+// Returns 0 if anything was created, EEXIST if the whole path existed,
+// EINVAL if the path is invalid or ENOMEM if a shared tree is full.
+int tree_create_all(Tree* tree, const char* path);
+
 int tree_remove(Tree* tree, const char* path);
 
 int tree_move(Tree* tree, const char* source, const char* target);
+
+// Create `target` as a copy of the folder `source` with all folders below it.
+// The source is read at one moment, the copy is built with no locks held,
+// on several threads if it is big, and then inserted at once.
+// Watches of the target's ancestors get a single create event of `target`.
+// Returns 0 or the same errors as tree_move: EINVAL, EBUSY if the source is
+// the root, ENOENT if the source or the parent of the target does not exist,
+// EEXIST if the target exists, -11 if the target lies inside the source
+// and ENOMEM if a shared tree is full.
+int tree_copy(Tree* tree, const char* source, const char* target);
+
+// Start or stop keeping Bloom filters of folder paths in children of the
+// root, which let lookups of most paths that do not exist (tree_list,
+// tree_stat, tree_remove, ...) stop after entering the first folder.
+// Filters are off in a new tree. While they are on, tree_move costs time
+// proportional to the number of moved folders, unless it moves a child
+// of the root to the root. Waits until no other operation is running.
+void tree_set_filters(Tree* tree, bool enabled);
+
+// Start or stop combining creates and removes that need a writer in the
+// parent folder: tree_remove, and tree_create in an empty or compressed
+// folder. Each one is published in the parent and whichever thread gets
+// the writer there applies all published ones at once, so many of them in
+// one folder do not wait for the writer one by one. Off in a new tree,
+// can be changed at any time. Has no effect on trees shared between processes.
+void tree_set_combining(Tree* tree, bool enabled);
+
+// Sizes of a folder, filled by tree_stat.
+typedef struct TreeStat {
+    size_t children; // Number of direct subfolders.
+    size_t descendants; // Number of all folders below, at any depth.
+    size_t depth; // Number of folders on the path, 0 for the root.
+} TreeStat;
+
+// Fill `info` with sizes of the folder under `path` in O(depth) time,
+// counts are maintained incrementally by tree_create, tree_remove and tree_move.
+// Returns 0, EINVAL if the path is invalid or ENOENT if the folder does not exist.
+int tree_stat(Tree* tree, const char* path, TreeStat* info);
+
+// An immutable copy of a whole tree, made for serving reads only.
+typedef struct TreeImage TreeImage;
+
+// Compile the tree, as it is at this moment, into an image that answers
+// lookups and listings without taking any locks or allocating memory.
+// Waits until no other operation is running and stops them all while the
+// image is built. The image does not follow later changes of the tree,
+// once they happen (see tree_image_is_current) it should be freed and
+// the tree frozen again.
+TreeImage* tree_freeze(Tree* tree);
+
+// Return whether no folder of `tree` was created, removed, moved or copied
+// since `image` was made from it by tree_freeze. Takes no locks, so with
+// other threads changing the tree the answer can be outdated at once.
+bool tree_image_is_current(const TreeImage* image, Tree* tree);
+
+// Free the image. Strings returned by tree_image_list become invalid.
+void tree_image_free(TreeImage* image);
+
+// Return the listing of `path` in the same format as tree_list, stored
+// inside the image, or NULL if the path is invalid or the folder does
+// not exist. The string must not be freed.
+const char* tree_image_list(const TreeImage* image, const char* path);
+
+// Like tree_stat, but for the image.
+int tree_image_stat(const TreeImage* image, const char* path, TreeStat* info);
+
+// Kinds of changes reported to watches.
+typedef enum TreeEventType {
+    TREE_EVENT_CREATE,
+    TREE_EVENT_REMOVE,
+    TREE_EVENT_MOVE,
+} TreeEventType;
+
+// A single change notification.
+// `path` is the created or removed folder, or the source of a move.
+// `target` is the destination of a move and NULL otherwise.
+// The event is one allocation, the caller should free it.
+typedef struct TreeEvent {
+    TreeEventType type;
+    char* path;
+    char* target;
+} TreeEvent;
+
+// Flags for tree_watch.
+// TREE_WATCH_CHILDREN reports changes of direct children of the watched folder,
+// TREE_WATCH_SUBTREE reports changes anywhere below it.
+#define TREE_WATCH_CHILDREN 1
+#define TREE_WATCH_SUBTREE 2
+
+typedef struct TreeWatch TreeWatch;
+
+// Register a watch on the folder under `path`.
+// The watch follows the folder when it (or an ancestor) is moved.
+// Returns NULL if the path is invalid or the folder does not exist.
+// All watches should be released with tree_unwatch before tree_free.
+TreeWatch* tree_watch(Tree* tree, const char* path, int flags);
+
+// Unregister the watch and free it together with undelivered events.
+void tree_unwatch(TreeWatch* watch);
+
+// Return the oldest undelivered event, or NULL if there is none.
+// Only one thread at a time may read events of a given watch.
+TreeEvent* tree_watch_next(TreeWatch* watch);
+
+// Return whether some events were dropped because the watch was not
+// read fast enough, and clear that information.
+bool tree_watch_overflowed(TreeWatch* watch);
+
+// Start logging every tree_list, tree_list_range, tree_create, tree_create_all,
+// tree_remove, tree_move and tree_copy call on the tree to `recorder`, or stop if it is NULL.
+// Folders existing at that moment are logged first as setup records,
+// so a replay can start from the same state. For an exact snapshot
+// the tree should not be modified during this call.
+// The recorder can be closed only after logging is stopped and
+// all calls in progress have returned.
+void tree_set_recorder(Tree* tree, TraceRecorder* recorder);
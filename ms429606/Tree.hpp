@@ -0,0 +1,290 @@
+#pragma once
+/* Author Mikołaj Szkaradek */
+
+// Header-only C++17 wrapper around the C tree API.
+// Paths are taken as std::string_view, listings are returned as views
+// into a buffer that the caller keeps and reuses, so repeated listings
+// do not allocate once the buffer has grown.
+//
+// BasicTree is parametrized by a lock policy, which decides whether
+// several operations can be composed into one atomic step:
+// - NoLock compiles all the locking out, every call goes straight to C,
+// - ReadWriteLock puts a reader around every single operation and
+//   a writer around transaction(), built on struct readwrite.
+
+#include <cerrno>
+#include <cstring>
+#include <exception>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+extern "C" {
+#include "Tree.h"
+#include "readers-writers-template.h"
+}
+
+namespace tree {
+
+// Null-terminated copy of a path kept on the stack.
+// Paths too long to be valid are replaced with "", which C rejects as EINVAL.
+class PathBuffer {
+public:
+    explicit PathBuffer(std::string_view path) noexcept
+    {
+        size_t len = path.size() <= MAX_PATH_LENGTH ? path.size() : 0;
+        std::memcpy(data_, path.data(), len);
+        data_[len] = '\0';
+    }
+
+    const char* c_str() const noexcept { return data_; }
+
+private:
+    char data_[MAX_PATH_LENGTH + 1];
+};
+
+// Holds a reader in `rw` for its lifetime.
+class ReaderGuard {
+public:
+    explicit ReaderGuard(struct readwrite& rw) : rw_(&rw) { rw_reader_preliminary_protocol(rw_); }
+    ReaderGuard(ReaderGuard&& other) noexcept : rw_(std::exchange(other.rw_, nullptr)) {}
+    ReaderGuard(const ReaderGuard&) = delete;
+    ReaderGuard& operator=(const ReaderGuard&) = delete;
+    ReaderGuard& operator=(ReaderGuard&&) = delete;
+    ~ReaderGuard()
+    {
+        if (rw_)
+            rw_reader_final_protocol(rw_);
+    }
+
+private:
+    struct readwrite* rw_;
+};
+
+// Holds a writer in `rw` for its lifetime.
+class WriterGuard {
+public:
+    explicit WriterGuard(struct readwrite& rw) : rw_(&rw) { rw_writer_preliminary_protocol(rw_); }
+    WriterGuard(WriterGuard&& other) noexcept : rw_(std::exchange(other.rw_, nullptr)) {}
+    WriterGuard(const WriterGuard&) = delete;
+    WriterGuard& operator=(const WriterGuard&) = delete;
+    WriterGuard& operator=(WriterGuard&&) = delete;
+    ~WriterGuard()
+    {
+        if (rw_)
+            rw_writer_final_protocol(rw_);
+    }
+
+private:
+    struct readwrite* rw_;
+};
+
+// Lock policy without any locking.
+struct NoLock {
+    struct Guard {
+        explicit Guard(NoLock&) noexcept {}
+    };
+    using Reader = Guard;
+    using Writer = Guard;
+};
+
+// Lock policy based on a single struct readwrite per tree.
+class ReadWriteLock {
+public:
+    ReadWriteLock() { rw_init(&rw_); }
+    ReadWriteLock(const ReadWriteLock&) = delete;
+    ReadWriteLock& operator=(const ReadWriteLock&) = delete;
+    ~ReadWriteLock() { rw_destroy(&rw_); }
+
+    struct Reader : ReaderGuard {
+        explicit Reader(ReadWriteLock& lock) : ReaderGuard(lock.rw_) {}
+    };
+    struct Writer : WriterGuard {
+        explicit Writer(ReadWriteLock& lock) : WriterGuard(lock.rw_) {}
+    };
+
+private:
+    struct readwrite rw_;
+};
+
+// Names of subfolders pointing into a buffer owned by the listing.
+// Reusing one Listing for many calls reuses its memory.
+// `Names` can be any container of std::string_view with clear and push_back.
+template <class Names = std::vector<std::string_view>>
+class Listing {
+public:
+    const Names& names() const noexcept { return names_; }
+
+private:
+    friend class TreeRef;
+
+    std::vector<char> buffer_;
+    Names names_;
+};
+
+// Non-owning view of a tree without any wrapper-level locking.
+// This is what transaction() hands to its callback.
+class TreeRef {
+public:
+    explicit TreeRef(Tree* tree) noexcept : tree_(tree) {}
+
+    int create(std::string_view path) { return tree_create(tree_, PathBuffer(path).c_str()); }
+
+    int create_all(std::string_view path)
+    {
+        return tree_create_all(tree_, PathBuffer(path).c_str());
+    }
+
+    int remove(std::string_view path) { return tree_remove(tree_, PathBuffer(path).c_str()); }
+
+    int move(std::string_view source, std::string_view target)
+    {
+        return tree_move(tree_, PathBuffer(source).c_str(), PathBuffer(target).c_str());
+    }
+
+    int stat(std::string_view path, TreeStat& info)
+    {
+        return tree_stat(tree_, PathBuffer(path).c_str(), &info);
+    }
+
+    // Fill `listing` with names of subfolders of `path`, in sorted order.
+    // Returns 0, EINVAL or ENOENT like tree_list_into.
+    template <class Names>
+    int list(std::string_view path, Listing<Names>& listing)
+    {
+        PathBuffer p(path);
+        std::vector<char>& buffer = listing.buffer_;
+        size_t needed = 0;
+        int err;
+        // The folder can grow between the calls, so retry until it fits.
+        while ((err = tree_list_into(tree_, p.c_str(), buffer.data(), buffer.size(), &needed))
+               == ERANGE)
+            buffer.resize(needed);
+        listing.names_.clear();
+        if (err != 0)
+            return err;
+
+        std::string_view all(buffer.data(), needed - 1);
+        while (!all.empty()) {
+            size_t comma = all.find(',');
+            listing.names_.push_back(all.substr(0, comma));
+            all.remove_prefix(comma == std::string_view::npos ? all.size() : comma + 1);
+        }
+        return 0;
+    }
+
+    // Call `f(std::string_view name)` for every subfolder of `path`, in sorted
+    // order, like tree_list_each: no lock of the tree is held meanwhile, so
+    // `f` may use it. If `f` returns bool, returning false stops the listing.
+    // An exception thrown by `f` stops the listing and is rethrown once
+    // tree_list_each has returned, it never unwinds through C.
+    template <class F>
+    int for_each(std::string_view path, F&& f)
+    {
+        struct Call {
+            std::remove_reference_t<F>& fn;
+            std::exception_ptr error;
+        } call{f, nullptr};
+        auto callback = [](const char* name, void* arg) noexcept -> bool {
+            Call& c = *static_cast<Call*>(arg);
+            try {
+                if constexpr (std::is_same_v<decltype(c.fn(std::string_view(name))), bool>)
+                    return c.fn(std::string_view(name));
+                else {
+                    c.fn(std::string_view(name));
+                    return true;
+                }
+            } catch (...) {
+                c.error = std::current_exception();
+                return false;
+            }
+        };
+        int err = tree_list_each(tree_, PathBuffer(path).c_str(), callback, &call);
+        if (call.error)
+            std::rethrow_exception(call.error);
+        return err;
+    }
+
+    Tree* get() const noexcept { return tree_; }
+
+private:
+    Tree* tree_;
+};
+
+// Owning tree with a lock policy, see the top of this file.
+template <class LockPolicy = NoLock>
+class BasicTree {
+public:
+    BasicTree() : tree_(tree_new()) {}
+    BasicTree(const BasicTree&) = delete;
+    BasicTree& operator=(const BasicTree&) = delete;
+    ~BasicTree() { tree_free(tree_); }
+
+    int create(std::string_view path)
+    {
+        typename LockPolicy::Reader guard(lock_);
+        return ref().create(path);
+    }
+
+    int create_all(std::string_view path)
+    {
+        typename LockPolicy::Reader guard(lock_);
+        return ref().create_all(path);
+    }
+
+    int remove(std::string_view path)
+    {
+        typename LockPolicy::Reader guard(lock_);
+        return ref().remove(path);
+    }
+
+    int move(std::string_view source, std::string_view target)
+    {
+        typename LockPolicy::Reader guard(lock_);
+        return ref().move(source, target);
+    }
+
+    int stat(std::string_view path, TreeStat& info)
+    {
+        typename LockPolicy::Reader guard(lock_);
+        return ref().stat(path, info);
+    }
+
+    template <class Names>
+    int list(std::string_view path, Listing<Names>& listing)
+    {
+        typename LockPolicy::Reader guard(lock_);
+        return ref().list(path, listing);
+    }
+
+    // Like TreeRef::for_each, but the reader of the lock policy is held
+    // while `f` runs, so `f` must not call this wrapper again (a waiting
+    // transaction would stop it), only the C API through get().
+    template <class F>
+    int for_each(std::string_view path, F&& f)
+    {
+        typename LockPolicy::Reader guard(lock_);
+        return ref().for_each(path, std::forward<F>(f));
+    }
+
+    // Run `f(TreeRef&)` with no other operation of this wrapper in progress
+    // and return its result. With NoLock nothing is excluded.
+    template <class F>
+    decltype(auto) transaction(F&& f)
+    {
+        typename LockPolicy::Writer guard(lock_);
+        TreeRef r = ref();
+        return std::forward<F>(f)(r);
+    }
+
+    Tree* get() const noexcept { return tree_; }
+
+private:
+    TreeRef ref() const noexcept { return TreeRef(tree_); }
+
+    Tree* tree_;
+    LockPolicy lock_;
+};
+
+} // namespace tree
@@ -0,0 +1,156 @@
+/* Author Mikołaj Szkaradek */
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "TreeImage.h"
+#include "err.h"
+#include "path_utils.h"
+
+typedef struct ImageFolder {
+    size_t first_child; // Subfolders are the next `children` folders from here.
+    size_t children;
+    size_t descendants;
+    size_t name; // Offset in names, the name ends with ',' or '\0'.
+    size_t name_length;
+} ImageFolder;
+
+struct TreeImage {
+    size_t count; // Number of folders, the root is folder 0.
+    size_t generation; // Of the tree when it was frozen.
+    ImageFolder* folders;
+    char* names; // Starts with '\0', the listing of folders without subfolders.
+    size_t names_length;
+    size_t names_capacity;
+    // Used only while the image is built.
+    size_t appended;
+    size_t next_child; // First folder of the next group of siblings.
+    size_t parent; // Folder whose subfolders are appended now.
+    size_t left; // Number of them still to append.
+};
+
+TreeImage* image_new(size_t count, size_t generation)
+{
+    TreeImage* image = malloc(sizeof(TreeImage));
+    CHECK_PTR(image);
+    image->count = count;
+    image->generation = generation;
+    image->folders = malloc(count * sizeof(ImageFolder));
+    CHECK_PTR(image->folders);
+    image->names_capacity = 8 * count + 1;
+    image->names = malloc(image->names_capacity);
+    CHECK_PTR(image->names);
+    image->names[0] = '\0';
+    image->names_length = 1;
+    image->appended = 0;
+    image->next_child = 1;
+    image->parent = 0;
+    image->left = 0;
+    return image;
+}
+
+void image_append(TreeImage* image, const char* name, size_t name_length,
+                  size_t children, size_t descendants)
+{
+    assert(image->appended < image->count);
+    size_t index = image->appended++;
+    ImageFolder* folder = &image->folders[index];
+    folder->first_child = image->next_child;
+    folder->children = children;
+    folder->descendants = descendants;
+    image->next_child += children;
+    if (index == 0) {
+        folder->name = 0;
+        folder->name_length = 0;
+        image->left = children;
+        return;
+    }
+
+    while (image->left == 0)
+        image->left = image->folders[++image->parent].children;
+    --image->left;
+    while (image->names_length + name_length + 1 > image->names_capacity) {
+        image->names_capacity *= 2;
+        image->names = realloc(image->names, image->names_capacity);
+        CHECK_PTR(image->names);
+    }
+    folder->name = image->names_length;
+    folder->name_length = name_length;
+    memcpy(image->names + image->names_length, name, name_length);
+    image->names[image->names_length + name_length] = image->left ? ',' : '\0';
+    image->names_length += name_length + 1;
+}
+
+size_t image_generation(const TreeImage* image)
+{
+    return image->generation;
+}
+
+void tree_image_free(TreeImage* image)
+{
+    free(image->folders);
+    free(image->names);
+    free(image);
+}
+
+// Return the index of the folder under the parsed path,
+// or SIZE_MAX if it does not exist.
+static size_t find_folder(const TreeImage* image, const char* path,
+                          const PathComponents* components)
+{
+    size_t index = 0;
+    for (size_t i = 0; i < components->count; ++i) {
+        const char* name = path + components->slash[i] + 1;
+        size_t length = components->slash[i + 1] - components->slash[i] - 1;
+        const ImageFolder* folder = &image->folders[index];
+        size_t low = folder->first_child, high = low + folder->children;
+        index = SIZE_MAX;
+        while (low < high && index == SIZE_MAX) {
+            size_t middle = low + (high - low) / 2;
+            const ImageFolder* child = &image->folders[middle];
+            size_t common = length < child->name_length ? length : child->name_length;
+            int cmp = memcmp(name, image->names + child->name, common);
+            if (cmp == 0)
+                cmp = (length > child->name_length) - (length < child->name_length);
+            if (cmp < 0)
+                high = middle;
+            else if (cmp > 0)
+                low = middle + 1;
+            else
+                index = middle;
+        }
+        if (index == SIZE_MAX)
+            return SIZE_MAX;
+    }
+    return index;
+}
+
+const char* tree_image_list(const TreeImage* image, const char* path)
+{
+    PathComponents components;
+    if (!parse_path(path, &components))
+        return NULL;
+    size_t index = find_folder(image, path, &components);
+    if (index == SIZE_MAX)
+        return NULL;
+    const ImageFolder* folder = &image->folders[index];
+    if (folder->children == 0)
+        return image->names;
+    return image->names + image->folders[folder->first_child].name;
+}
+
+int tree_image_stat(const TreeImage* image, const char* path, TreeStat* info)
+{
+    PathComponents components;
+    if (!parse_path(path, &components))
+        return EINVAL;
+    size_t index = find_folder(image, path, &components);
+    if (index == SIZE_MAX)
+        return ENOENT;
+    info->children = image->folders[index].children;
+    info->descendants = image->folders[index].descendants;
+    info->depth = components.count;
+    return 0;
+}
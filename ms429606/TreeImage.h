@@ -0,0 +1,24 @@
+#pragma once
+#include <sys/types.h>
+
+#include "Tree.h"
+
+// Building a TreeImage, used by tree_freeze.
+// Folders are stored in breadth-first order, so subfolders of each folder
+// are next to each other, sorted, and found by binary search. Their names
+// are stored in the same order, separated by ',' and ended with '\0',
+// so they already form the listing of their parent.
+
+// Return an empty image for `count` folders, to be filled with image_append,
+// of the tree at `generation` (see tree_image_is_current).
+TreeImage* image_new(size_t count, size_t generation);
+
+// Return the generation given to image_new.
+size_t image_generation(const TreeImage* image);
+
+// Append the next folder: first the root, then subfolders of every folder,
+// following the order of the folders, each in sorted order.
+// `name` of length `name_length` is ignored for the root.
+// At most `count` folders given to image_new can be appended.
+void image_append(TreeImage* image, const char* name, size_t name_length,
+                  size_t children, size_t descendants);
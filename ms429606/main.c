@@ -4,10 +4,13 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include "path_utils.h"
+#include "SharedArena.h"
 #include "Tree.h"
 
 void print_map(HashMap* map) {
@@ -42,6 +45,55 @@ void print_map(HashMap* map) {
     return result;
 }*/
 
+// Count subfolders of /b/<name>/, listing them from inside tree_list_each.
+static bool count_grandchildren(const char* name, void* arg) {
+    void** args = arg;
+    char path[MAX_PATH_LENGTH + 1];
+    snprintf(path, sizeof(path), "/b/%s/", name);
+    char* list_content = tree_list(args[0], path);
+    assert(list_content);
+    *(size_t*)args[1] += strlen(list_content) > 0;
+    free(list_content);
+    return true;
+}
+
+#define HOT_THREADS 4
+#define HOT_ROUNDS 50
+
+typedef struct HotFolder {
+    Tree* tree;
+    int thread;
+} HotFolder;
+
+// Create and remove folders of /h/ named by the thread and a letter,
+// the others do the same at once. Folders with even letters are left.
+static void* create_remove_hot(void* data) {
+    HotFolder* hot = data;
+    char path[MAX_PATH_LENGTH + 1];
+    for (int round = 0; round < HOT_ROUNDS; ++round) {
+        for (int letter = 0; letter < 26; ++letter) {
+            snprintf(path, sizeof(path), "/h/%c%c/", 'a' + hot->thread, 'a' + letter);
+            assert(tree_create(hot->tree, path) == 0);
+            assert(tree_create(hot->tree, path) == EEXIST);
+            if (round + 1 < HOT_ROUNDS || letter % 2)
+                assert(tree_remove(hot->tree, path) == 0);
+        }
+    }
+    assert(tree_remove(hot->tree, "/h/") == ENOTEMPTY);
+    return NULL;
+}
+
+// List a missing folder, so the call is recorded under a second thread.
+static void* list_missing(void* tree) {
+    assert(tree_list(tree, "/x/") == NULL);
+    return NULL;
+}
+
+// Compare strings of a trace record, either may be NULL.
+static bool same_string(const char* a, const char* b) {
+    return a && b ? strcmp(a, b) == 0 : a == b;
+}
+
 int main(void) {
     /*HashMap* map = hmap_new();
     hmap_insert(map, "a", hmap_new());
@@ -71,8 +123,259 @@ int main(void) {
     list_content = tree_list(tree, "/b/");
     assert(strcmp(list_content, "c") == 0);
     free(list_content);
+
+    TreeWatch* watch = tree_watch(tree, "/b/", TREE_WATCH_CHILDREN);
+    assert(watch);
+    assert(tree_create(tree, "/b/e/") == 0);
+    assert(tree_create(tree, "/b/c/f/") == 0);
+    TreeEvent* event = tree_watch_next(watch);
+    assert(event && event->type == TREE_EVENT_CREATE && strcmp(event->path, "/b/e/") == 0);
+    free(event);
+    assert(tree_watch_next(watch) == NULL);
+    assert(!tree_watch_overflowed(watch));
+    tree_unwatch(watch);
+    watch = tree_watch(tree, "/", TREE_WATCH_SUBTREE);
+    assert(tree_create(tree, "/b/c/f/g/") == 0 && tree_remove(tree, "/b/c/f/g/") == 0);
+    event = tree_watch_next(watch);
+    assert(event && event->type == TREE_EVENT_CREATE && strcmp(event->path, "/b/c/f/g/") == 0);
+    free(event);
+    event = tree_watch_next(watch);
+    assert(event && event->type == TREE_EVENT_REMOVE);
+    free(event);
+    tree_unwatch(watch);
+
+    assert(tree_create(tree, "/b/a/") == 0);
+    list_content = tree_list_range(tree, "/b/", NULL, 2);
+    assert(strcmp(list_content, "a,c") == 0);
+    free(list_content);
+    list_content = tree_list_range(tree, "/b/", "c", 2);
+    assert(strcmp(list_content, "e") == 0);
+    free(list_content);
+    TreeStat stat;
+    assert(tree_stat(tree, "/", &stat) == 0);
+    assert(stat.children == 2 && stat.descendants == 7 && stat.depth == 0);
+    assert(tree_stat(tree, "/b/c/", &stat) == 0);
+    assert(stat.children == 1 && stat.descendants == 1 && stat.depth == 2);
+    assert(tree_stat(tree, "/x/", &stat) == ENOENT);
+    assert(tree_create_all(tree, "/a/b/x/y/z/") == 0);
+    assert(tree_create_all(tree, "/a/b/x/y/") == EEXIST);
+    assert(tree_stat(tree, "/a/", &stat) == 0 && stat.descendants == 4);
+    list_content = tree_list(tree, "/a/b/x/y/");
+    assert(strcmp(list_content, "z") == 0);
+    free(list_content);
+    char buffer[8];
+    size_t needed;
+    assert(tree_list_into(tree, "/b/", buffer, sizeof(buffer), &needed) == 0);
+    assert(strcmp(buffer, "a,c,e") == 0 && needed == 6);
+    assert(tree_list_into(tree, "/b/", buffer, 3, &needed) == ERANGE && needed == 6);
+    assert(tree_list_into(tree, "/x/", buffer, sizeof(buffer), &needed) == ENOENT);
+    size_t nonempty = 0;
+    void* each_args[] = {tree, &nonempty};
+    assert(tree_list_each(tree, "/b/", count_grandchildren, each_args) == 0 && nonempty == 1);
+    list_content = tree_list_range(tree, "/b/", "e", 2);
+    assert(strcmp(list_content, "") == 0);
+    free(list_content);
+    assert(tree_create(tree, "/a/b/x/w/") == 0);
+    assert(tree_remove(tree, "/a/b/x/y/") == ENOTEMPTY);
+    assert(tree_remove(tree, "/a/b/x/y/z/") == 0);
+    assert(tree_move(tree, "/a/b/x/", "/b/x/") == 0);
+    assert(tree_stat(tree, "/b/x/w/", &stat) == 0);
+    assert(stat.children == 0 && stat.descendants == 0 && stat.depth == 3);
+    list_content = tree_list(tree, "/b/x/");
+    assert(strcmp(list_content, "w,y") == 0);
+    free(list_content);
+    tree_set_filters(tree, true);
+    assert(tree_list(tree, "/b/x/v/") == NULL);
+    assert(tree_create(tree, "/b/x/v/") == 0);
+    assert(tree_move(tree, "/b/x/", "/a/x/") == 0);
+    assert(tree_stat(tree, "/a/x/v/", &stat) == 0 && stat.depth == 3);
+    assert(tree_stat(tree, "/b/x/v/", &stat) == ENOENT);
+    assert(tree_remove(tree, "/a/x/v/") == 0);
+    assert(tree_remove(tree, "/a/x/v/") == ENOENT);
+    tree_set_filters(tree, false);
+    TreeStat copied;
+    assert(tree_copy(tree, "/b/", "/a/y/") == 0);
+    assert(tree_copy(tree, "/b/", "/a/y/") == EEXIST);
+    assert(tree_copy(tree, "/b/", "/b/c/y/") == -11);
+    assert(tree_copy(tree, "/x/", "/a/z/") == ENOENT);
+    assert(tree_stat(tree, "/b/", &stat) == 0 && tree_stat(tree, "/a/y/", &copied) == 0);
+    assert(stat.children == copied.children && stat.descendants == copied.descendants);
+    list_content = tree_list(tree, "/a/y/");
+    assert(strcmp(list_content, "a,c,e") == 0);
+    free(list_content);
+    TreeImage* image = tree_freeze(tree);
+    assert(strcmp(tree_image_list(image, "/a/y/"), "a,c,e") == 0);
+    assert(strcmp(tree_image_list(image, "/a/x/w/"), "") == 0);
+    assert(tree_image_list(image, "/a/y/d/") == NULL);
+    assert(tree_stat(tree, "/a/", &stat) == 0 && tree_image_stat(image, "/a/", &copied) == 0);
+    assert(stat.children == copied.children && stat.descendants == copied.descendants);
+    assert(tree_image_is_current(image, tree));
+    assert(tree_remove(tree, "/a/y/e/") == 0);
+    assert(!tree_image_is_current(image, tree));
+    tree_image_free(image);
+    image = tree_freeze(tree);
+    assert(strcmp(tree_image_list(image, "/a/y/"), "a,c") == 0);
+    assert(tree_remove(tree, "/a/y/x/") == ENOENT && tree_image_is_current(image, tree));
+    tree_image_free(image);
+    tree_set_combining(tree, true);
+    assert(tree_remove(tree, "/a/y/c/") == ENOTEMPTY);
+    assert(tree_remove(tree, "/a/y/c/f/") == 0);
+    assert(tree_create(tree, "/a/y/c/f/") == 0);
+    assert(tree_create(tree, "/a/y/c/f/") == EEXIST);
+    assert(tree_remove(tree, "/a/y/q/") == ENOENT);
+    assert(tree_remove(tree, "/a/y/a/") == 0);
+    list_content = tree_list(tree, "/a/y/");
+    assert(strcmp(list_content, "c") == 0);
+    free(list_content);
+    tree_set_combining(tree, false);
+    tree_free(tree);
+
+    tree = tree_new();
+    tree_set_combining(tree, true);
+    assert(tree_create(tree, "/h/") == 0);
+    pthread_t hot_threads[HOT_THREADS];
+    HotFolder hot[HOT_THREADS];
+    for (int t = 0; t < HOT_THREADS; ++t) {
+        hot[t] = (HotFolder){ tree, t };
+        assert(pthread_create(&hot_threads[t], NULL, create_remove_hot, &hot[t]) == 0);
+    }
+    char expected[HOT_THREADS * 13 * 3];
+    size_t expected_length = 0;
+    for (int t = 0; t < HOT_THREADS; ++t) {
+        assert(pthread_join(hot_threads[t], NULL) == 0);
+        for (int letter = 0; letter < 26; letter += 2)
+            expected_length += sprintf(expected + expected_length, "%s%c%c",
+                                       expected_length ? "," : "", 'a' + t, 'a' + letter);
+    }
+    list_content = tree_list(tree, "/h/");
+    assert(strcmp(list_content, expected) == 0);
+    free(list_content);
+    assert(tree_stat(tree, "/", &stat) == 0 && stat.descendants == 1 + HOT_THREADS * 13);
     tree_free(tree);
 
+    FILE* segment = tmpfile();
+    assert(segment && ftruncate(fileno(segment), 1 << 20) == 0);
+    tree = tree_new_shared(fileno(segment));
+    assert(tree && tree_create(tree, "/a/") == 0);
+    pid_t child = fork();
+    if (child == 0) {
+        tree_detach(tree);
+        Tree* attached = tree_attach(fileno(segment));
+        exit(attached && tree_create(attached, "/a/b/") == 0 ? 0 : 1);
+    }
+    int status;
+    assert(waitpid(child, &status, 0) == child && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    list_content = tree_list(tree, "/a/");
+    assert(strcmp(list_content, "b") == 0);
+    free(list_content);
+    assert(tree_watch(tree, "/", TREE_WATCH_CHILDREN) == NULL);
+    tree_free(tree);
+    fclose(segment);
+
+    // A request that does not fit takes nothing from the arena.
+    segment = tmpfile();
+    assert(segment && ftruncate(fileno(segment), 1 << 16) == 0);
+    SharedArena* arena = arena_create(fileno(segment));
+    assert(arena && arena_alloc(arena, 1 << 16) == NULL);
+    void* block = arena_alloc(arena, 0);
+    assert(block && arena_alloc(arena, 1 << 14) != NULL);
+    arena_free(arena, block);
+    assert(arena_alloc(arena, 1) == block);
+    arena_detach(arena);
+    fclose(segment);
+
+    segment = tmpfile();
+    assert(segment && ftruncate(fileno(segment), 1 << 16) == 0);
+    tree = tree_new_shared(fileno(segment));
+    assert(tree && tree_create_all(tree, "/a/b/") == 0);
+    char path[MAX_PATH_LENGTH + 1];
+    size_t created = 0;
+    int result;
+    do {
+        snprintf(path, sizeof(path), "/a/b/%c%c/", 'a' + (int)created / 26, 'a' + (int)created % 26);
+    } while ((result = tree_create(tree, path)) == 0 && ++created < 676);
+    assert(result == ENOMEM && created > 2);
+    assert(tree_copy(tree, "/a/", "/c/") == ENOMEM && tree_stat(tree, "/c/", &stat) == ENOENT);
+    // Space freed by failed calls can be enough for some of the next ones.
+    result = tree_move(tree, "/a/b/aa/", "/a/aa/");
+    assert(result == 0 || result == ENOMEM);
+    assert((tree_stat(tree, "/a/b/aa/", &stat) == 0) == (result == ENOMEM));
+    result = tree_create_all(tree, "/a/x/y/z/");
+    assert(result == 0 || result == ENOMEM);
+    assert(tree_stat(tree, "/a/", &stat) == 0
+           && stat.descendants == created + 1 + (result == 0 ? 3 : 0));
+    assert(tree_remove(tree, "/a/b/ab/") == 0 && tree_create(tree, "/a/b/ab/") == 0);
+    tree_free(tree);
+    fclose(segment);
+
+    // Recorded calls come back from the trace file as they were made.
+    char trace_name[] = "/tmp/tree_traceXXXXXX";
+    int trace_fd = mkstemp(trace_name);
+    assert(trace_fd >= 0 && close(trace_fd) == 0);
+    TraceRecorder* recorder = trace_open(trace_name);
+    assert(recorder);
+    tree = tree_new();
+    assert(tree_create(tree, "/a/") == 0);
+    tree_set_recorder(tree, recorder);
+    assert(tree_create(tree, "/a/b/") == 0);
+    assert(tree_create(tree, "/a/b/") == EEXIST);
+    list_content = tree_list_range(tree, "/a/", "a", 5);
+    assert(strcmp(list_content, "b") == 0);
+    free(list_content);
+    assert(tree_move(tree, "/a/b/", "/c/") == 0);
+    pthread_t lister;
+    assert(pthread_create(&lister, NULL, list_missing, tree) == 0);
+    assert(pthread_join(lister, NULL) == 0);
+    tree_set_recorder(tree, NULL);
+    tree_free(tree);
+    // Bigger than a whole thread buffer, so written directly, and with
+    // strings cut to UINT16_MAX bytes.
+    size_t long_length = UINT16_MAX + 100;
+    char* long_path = malloc(long_length + 1);
+    assert(long_path);
+    for (size_t i = 0; i < long_length; ++i)
+        long_path[i] = 'a' + i % 26;
+    long_path[long_length] = '\0';
+    trace_record(recorder, TRACE_OP_COPY, long_path, long_path + 1, 0, trace_now(), ENOMEM);
+    trace_close(recorder);
+
+    struct {
+        TraceOp op;
+        const char* path;
+        const char* target;
+        uint32_t limit;
+        int32_t result;
+        uint32_t thread;
+    } calls[] = {
+        { TRACE_OP_SETUP, "/a/", NULL, 0, 0, 0 },
+        { TRACE_OP_CREATE, "/a/b/", NULL, 0, 0, 0 },
+        { TRACE_OP_CREATE, "/a/b/", NULL, 0, EEXIST, 0 },
+        { TRACE_OP_LIST_RANGE, "/a/", "a", 5, 0, 0 },
+        { TRACE_OP_MOVE, "/a/b/", "/c/", 0, 0, 0 },
+        { TRACE_OP_LIST, "/x/", NULL, 0, -1, 1 },
+        { TRACE_OP_COPY, NULL, NULL, 0, ENOMEM, 0 },
+    };
+    size_t call_count = sizeof(calls) / sizeof(calls[0]);
+    size_t record_count;
+    TraceRecord* records = trace_read_all(trace_name, &record_count);
+    assert(records && record_count == call_count);
+    for (size_t i = 0; i + 1 < call_count; ++i) {
+        assert(records[i].op == calls[i].op);
+        assert(same_string(records[i].path, calls[i].path));
+        assert(same_string(records[i].target, calls[i].target));
+        assert(records[i].limit == calls[i].limit);
+        assert(records[i].result == calls[i].result);
+        assert(records[i].thread == calls[i].thread);
+    }
+    TraceRecord* copy = &records[call_count - 1];
+    assert(copy->op == TRACE_OP_COPY && copy->result == ENOMEM && copy->thread == 0);
+    assert(strlen(copy->path) == UINT16_MAX && strncmp(copy->path, long_path, UINT16_MAX) == 0);
+    assert(strlen(copy->target) == UINT16_MAX
+           && strncmp(copy->target, long_path + 1, UINT16_MAX) == 0);
+    trace_records_free(records, record_count);
+    free(long_path);
+    assert(unlink(trace_name) == 0);
+
 //    size_t size;
     /*const char* so = "/a/b/c/";
     const char* ta = "/ffas/";
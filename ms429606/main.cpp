@@ -0,0 +1,75 @@
+/* Author Mikołaj Szkaradek */
+
+#include "Tree.hpp"
+
+#include <cassert>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+int main()
+{
+    tree::BasicTree<tree::ReadWriteLock> t;
+    assert(t.create("/a/") == 0);
+    assert(t.create("/b/") == 0);
+    assert(t.create("/a/c/") == 0);
+    assert(t.create_all("/a/d/e/") == 0);
+    assert(t.create("/a/") == EEXIST);
+
+    tree::Listing<> listing;
+    assert(t.list("/", listing) == 0);
+    assert(listing.names().size() == 2 && listing.names()[0] == "a" && listing.names()[1] == "b");
+    assert(t.list("/a/d/e/", listing) == 0 && listing.names().empty());
+    assert(t.list("/x/", listing) == ENOENT);
+
+    // Paths longer than MAX_PATH_LENGTH are rejected, not cut.
+    std::string long_path = "/";
+    while (long_path.size() <= MAX_PATH_LENGTH)
+        long_path += "a/";
+    assert(t.create(long_path) == EINVAL);
+    assert(t.list(long_path, listing) == EINVAL);
+    assert(t.create("a") == EINVAL);
+
+    std::string names;
+    assert(t.for_each("/a/", [&](std::string_view name) { names += name; }) == 0);
+    assert(names == "cd");
+    size_t calls = 0;
+    assert(t.for_each("/a/", [&](std::string_view) { return ++calls < 1; }) == 0);
+    assert(calls == 1);
+    assert(t.for_each("/x/", [](std::string_view) {}) == ENOENT);
+
+    // The callback may use the C API, no lock of the tree is held.
+    size_t nonempty = 0;
+    assert(t.for_each("/a/", [&](std::string_view name) {
+        tree::TreeRef ref(t.get());
+        tree::Listing<> inner;
+        assert(ref.list("/a/" + std::string(name) + "/", inner) == 0);
+        nonempty += !inner.names().empty();
+    }) == 0);
+    assert(nonempty == 1);
+
+    // An exception from the callback is rethrown after the listing returns.
+    bool thrown = false;
+    try {
+        t.for_each("/a/", [](std::string_view) { throw std::runtime_error("stop"); });
+    } catch (const std::runtime_error&) {
+        thrown = true;
+    }
+    assert(thrown);
+    assert(t.create("/a/f/") == 0);
+
+    int moved = t.transaction([](tree::TreeRef& r) {
+        if (r.move("/a/c/", "/b/c/") != 0)
+            return -1;
+        return r.remove("/a/f/");
+    });
+    assert(moved == 0);
+    TreeStat stat;
+    assert(t.stat("/b/c/", stat) == 0 && stat.depth == 2);
+    assert(t.stat("/a/", stat) == 0 && stat.children == 1 && stat.descendants == 2);
+
+    tree::BasicTree<> unlocked;
+    assert(unlocked.transaction([](tree::TreeRef& r) { return r.create("/x/"); }) == 0);
+    assert(unlocked.list("/", listing) == 0 && listing.names().size() == 1);
+    return 0;
+}
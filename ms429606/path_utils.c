@@ -1,164 +1,256 @@
 #include "path_utils.h"
 #include "err.h"
 
-#include <assert.h>
-#include <stdio.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <string.h>
 
 bool is_path_valid(const char* path)
 {
-    size_t len = strlen(path);
-    if (len == 0 || len > MAX_PATH_LENGTH)
+    return parse_path(path, NULL);
+}
+
+/* Author of functions below: Mikołaj Szkaradek */
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PATH_SIMD 1
+#include <immintrin.h>
+#endif
+
+// Record the '/' at `pos` and check that the component before it has
+// an allowed length. `*count` is the number of '/' seen before.
+static inline __attribute__((always_inline))
+bool add_slash(PathComponents* components, size_t* count, size_t* last, size_t pos)
+{
+    if (pos >= MAX_PATH_LENGTH)
         return false;
-    if (path[0] != '/' || path[len - 1] != '/')
+    if (*count > 0 && (pos - *last < 2 || pos - *last > MAX_FOLDER_NAME_LENGTH + 1))
         return false;
-    const char* name_start = path + 1; // Start of current path component, just after '/'.
-    while (name_start < path + len) {
-        char* name_end = strchr(name_start, '/'); // End of current path component, at '/'.
-        if (!name_end || name_end == name_start || name_end > name_start + MAX_FOLDER_NAME_LENGTH)
-            return false;
-        for (const char* p = name_start; p != name_end; ++p)
-            if (*p < 'a' || *p > 'z')
-                return false;
-        name_start = name_end + 1;
-    }
+    if (components)
+        components->slash[*count] = pos;
+    (*count)++;
+    *last = pos;
     return true;
 }
 
-const char* split_path(const char* path, char* component)
+// Check the final length and the last '/' of a path of length `len`.
+static inline __attribute__((always_inline))
+bool finish_path(PathComponents* components, size_t count, size_t last, size_t len)
 {
-    const char* subpath = strchr(path + 1, '/'); // Pointer to second '/' character.
-    if (!subpath) // Path is "/".
-        return NULL;
-    if (component) {
-        size_t len = subpath - (path + 1);
-        assert(len >= 1 && len <= MAX_FOLDER_NAME_LENGTH);
-        strncpy(component, path + 1, len);
-        component[len] = '\0';
-    }
-    return subpath;
+    if (len == 0 || len > MAX_PATH_LENGTH || last != len - 1)
+        return false;
+    if (components)
+        components->count = count - 1;
+    return true;
 }
 
-char* make_path_to_parent(const char* path, char* component)
+static bool parse_path_scalar(const char* path, PathComponents* components)
 {
-    size_t len = strlen(path);
-    if (len == 1) // Path is "/".
-        return NULL;
-    const char* p = path + len - 2; // Point before final '/' character.
-    // Move p to last-but-one '/' character.
-    while (*p != '/')
-        p--;
-
-    size_t subpath_len = p - path + 1; // Include '/' at p.
-    char* result = malloc(subpath_len + 1); // Include terminating null character.
-    CHECK_PTR(result);
-    strncpy(result, path, subpath_len);
-    result[subpath_len] = '\0';
-
-    if (component) {
-        size_t component_len = len - subpath_len - 1; // Skip final '/' as well.
-        assert(component_len >= 1 && component_len <= MAX_FOLDER_NAME_LENGTH);
-        strncpy(component, p + 1, component_len);
-        component[component_len] = '\0';
+    if (path[0] != '/')
+        return false;
+    size_t count = 0, last = 0, pos = 0;
+    for (; path[pos]; ++pos) {
+        if (pos >= MAX_PATH_LENGTH)
+            return false;
+        if (path[pos] == '/') {
+            if (!add_slash(components, &count, &last, pos))
+                return false;
+        } else if (path[pos] < 'a' || path[pos] > 'z') {
+            return false;
+        }
     }
+    return finish_path(components, count, last, pos);
+}
 
-    return result;
+#ifdef PATH_SIMD
+
+// Bit i of each mask describes byte i of an aligned chunk:
+// slash for '/', zero for '\0', bad for anything not in [a-z/].
+typedef struct ChunkMasks {
+    uint32_t slash, zero, bad;
+} ChunkMasks;
+
+typedef ChunkMasks (*ChunkScanner)(const char* chunk);
+
+__attribute__((target("sse2"), no_sanitize_address)) static inline __attribute__((always_inline))
+ChunkMasks scan_chunk_sse2(const char* chunk)
+{
+    __m128i v = *(const __m128i*)chunk;
+    __m128i slash = _mm_cmpeq_epi8(v, _mm_set1_epi8('/'));
+    __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('a' - 1)),
+                                  _mm_cmpgt_epi8(_mm_set1_epi8('z' + 1), v));
+    ChunkMasks masks;
+    masks.slash = (uint32_t)_mm_movemask_epi8(slash);
+    masks.zero = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128()));
+    masks.bad = ~(uint32_t)_mm_movemask_epi8(_mm_or_si128(slash, alpha)) & 0xFFFFu;
+    return masks;
 }
 
-// A wrapper for using strcmp in qsort.
-// The arguments here are actually pointers to (const char*).
-static int compare_string_pointers(const void* p1, const void* p2)
+__attribute__((target("avx2"), no_sanitize_address)) static inline __attribute__((always_inline))
+ChunkMasks scan_chunk_avx2(const char* chunk)
 {
-    return strcmp(*(const char**)p1, *(const char**)p2);
+    __m256i v = *(const __m256i*)chunk;
+    __m256i slash = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('/'));
+    __m256i alpha = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('a' - 1)),
+                                     _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), v));
+    ChunkMasks masks;
+    masks.slash = (uint32_t)_mm256_movemask_epi8(slash);
+    masks.zero = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+    masks.bad = ~(uint32_t)_mm256_movemask_epi8(_mm256_or_si256(slash, alpha));
+    return masks;
 }
 
-const char** make_map_contents_array(HashMap* map)
+// Scan the path in aligned chunks of `width` bytes. Aligned loads never
+// cross a page boundary, so reading a little before the start and after
+// the end of the string is safe, those bytes are masked out.
+// These functions are excluded from AddressSanitizer, which cannot know that.
+static inline __attribute__((always_inline))
+bool parse_path_chunks(const char* path, PathComponents* components,
+                       size_t width, ChunkScanner scan_chunk)
 {
-    size_t n_keys = hmap_size(map);
-    const char** result = calloc(n_keys + 1, sizeof(char*));
-    CHECK_PTR(result);
-    HashMapIterator it = hmap_iterator(map);
-    const char** key = result;
-    void* value = NULL;
-    while (hmap_next(map, &it, key, &value)) {
-        key++;
+    if (path[0] != '/')
+        return false;
+    size_t skip = (uintptr_t)path & (width - 1);
+    const char* chunk = path - skip;
+    size_t count = 0, last = 0;
+    while (true) {
+        ChunkMasks masks = scan_chunk(chunk);
+        size_t offset = chunk - path + skip; // Position of the first unmasked byte.
+        uint32_t slash = masks.slash >> skip;
+        uint32_t zero = masks.zero >> skip;
+        uint32_t bad = masks.bad >> skip;
+        uint32_t in_path = zero ? (1u << __builtin_ctz(zero)) - 1 : ~0u;
+        if (bad & in_path)
+            return false;
+        for (slash &= in_path; slash; slash &= slash - 1) {
+            if (!add_slash(components, &count, &last, offset + __builtin_ctz(slash)))
+                return false;
+        }
+        if (zero)
+            return finish_path(components, count, last, offset + __builtin_ctz(zero));
+        if (offset + width - skip > MAX_PATH_LENGTH)
+            return false;
+        chunk += width;
+        skip = 0;
     }
-    *key = NULL; // Set last array element to NULL.
-    qsort(result, n_keys, sizeof(char*), compare_string_pointers);
-    return result;
 }
 
-char* make_map_contents_string(HashMap* map)
+__attribute__((target("sse2"), no_sanitize_address))
+static bool parse_path_sse2(const char* path, PathComponents* components)
+{
+    return parse_path_chunks(path, components, 16, scan_chunk_sse2);
+}
+
+__attribute__((target("avx2"), no_sanitize_address))
+static bool parse_path_avx2(const char* path, PathComponents* components)
 {
-    const char** keys = make_map_contents_array(map);
+    return parse_path_chunks(path, components, 32, scan_chunk_avx2);
+}
 
-    unsigned int result_size = 0; // Including ending null character.
-    for (const char** key = keys; *key; ++key)
-        result_size += strlen(*key) + 1;
+#endif // PATH_SIMD
 
-    // Return empty string if map is empty.
-    if (!result_size) {
-        // Note we can't just return "", as it can't be free'd.
-        char* result = malloc(1);
-        CHECK_PTR(result);
-        free(keys);
-        *result = '\0';
-        return result;
-    }
+typedef bool (*PathParser)(const char* path, PathComponents* components);
 
-    char* result = malloc(result_size);
-    CHECK_PTR(result);
-    char* position = result;
-    for (const char** key = keys; *key; ++key) {
-        size_t keylen = strlen(*key);
-        assert(position + keylen <= result + result_size);
-        strcpy(position, *key); // NOLINT: array size already checked.
-        position += keylen;
-        *position = ',';
-        position++;
+// Pick the widest implementation the CPU supports.
+static PathParser choose_path_parser(void)
+{
+#ifdef PATH_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return parse_path_avx2;
+    if (__builtin_cpu_supports("sse2"))
+        return parse_path_sse2;
+#endif
+    return parse_path_scalar;
+}
+
+bool parse_path(const char* path, PathComponents* components)
+{
+    static _Atomic(PathParser) parser = NULL;
+    PathParser p = atomic_load_explicit(&parser, memory_order_relaxed);
+    if (!p) {
+        p = choose_path_parser();
+        atomic_store_explicit(&parser, p, memory_order_relaxed);
     }
-    position--;
-    *position = '\0';
-    free(keys);
-    return result;
+    return p(path, components);
 }
 
-/* Author of functions below: Mikołaj Szkaradek */
+void path_component(const char* path, const PathComponents* components, size_t i,
+                    char* component)
+{
+    size_t start = components->slash[i] + 1;
+    size_t len = components->slash[i + 1] - start;
+    memcpy(component, path + start, len);
+    component[len] = '\0';
+}
 
-char** make_path_folders_array(const char* path, size_t *size)
+size_t common_components(const char* path1, const PathComponents* components1,
+                         const char* path2, const PathComponents* components2)
 {
-    size_t path_folders_count = 0;
-    if (strlen(path) == 1) return NULL;
-    const char* path_ptr = path + 1; // We skip first '/'.
-    while (*path_ptr != '\0') {
-        if (*path_ptr == '/') path_folders_count++;
-        path_ptr++;
-    }
-    *size = path_folders_count;
-
-    char component[MAX_FOLDER_NAME_LENGTH + 1];
-    const char* subpath = path;
-    char** path_folders = malloc((path_folders_count + 1) * sizeof(char*));
-    CHECK_PTR(path_folders);
-
-    int i = 0;
-    while ((subpath = split_path(subpath, component))) {
-        path_folders[i] = malloc((MAX_FOLDER_NAME_LENGTH + 1) * sizeof (char));
-        CHECK_PTR(path_folders[i]);
-        strcpy(path_folders[i], component);
+    size_t i = 0;
+    while (i < components1->count && i < components2->count) {
+        size_t len1 = components1->slash[i + 1] - components1->slash[i];
+        size_t len2 = components2->slash[i + 1] - components2->slash[i];
+        if (len1 != len2 || memcmp(path1 + components1->slash[i],
+                                   path2 + components2->slash[i], len1) != 0)
+            break;
         i++;
     }
+    return i;
+}
 
-    return path_folders;
+size_t write_list_range(StripedMap* map, const char* after, size_t limit,
+                        char* buffer, size_t capacity)
+{
+    const char* key;
+    size_t size = 1; // Ending null character.
+    size_t count = 0;
+    StripedMapIterator it = smap_iterator_after(map, after);
+    while (count < limit && smap_next(map, &it, &key, NULL)) {
+        size_t keylen = strlen(key);
+        size_t separator = count > 0;
+        if (size + separator + keylen <= capacity) {
+            if (separator)
+                buffer[size - 1] = ',';
+            memcpy(buffer + size - 1 + separator, key, keylen);
+        }
+        size += separator + keylen;
+        count++;
+    }
+    if (size <= capacity)
+        buffer[size - 1] = '\0';
+    else if (capacity > 0)
+        buffer[0] = '\0';
+    return size;
 }
 
-void free_array_of_strings(char** arr, size_t size)
+char* make_list_range_string(StripedMap* map, const char* after, size_t limit)
 {
-    for (size_t i = 0; i < size; i++) {
-        if (arr[i]) free(arr[i]);
+    // One pass over the map, the buffer grows as names come.
+    size_t capacity = 64;
+    char* result = malloc(capacity);
+    CHECK_PTR(result);
+    const char* key;
+    size_t size = 0; // Without the ending null character.
+    size_t count = 0;
+    StripedMapIterator it = smap_iterator_after(map, after);
+    while (count < limit && smap_next(map, &it, &key, NULL)) {
+        size_t keylen = strlen(key);
+        size_t separator = count > 0;
+        if (size + separator + keylen + 1 > capacity) {
+            while (size + separator + keylen + 1 > capacity)
+                capacity *= 2;
+            result = realloc(result, capacity);
+            CHECK_PTR(result);
+        }
+        if (separator)
+            result[size] = ',';
+        memcpy(result + size + separator, key, keylen);
+        size += separator + keylen;
+        count++;
     }
-    if (arr) free(arr);
+    result[size] = '\0';
+    return result;
 }
 
 bool moving_to_subtree(const char* source, const char* target)
@@ -174,32 +266,3 @@ bool moving_to_subtree(const char* source, const char* target)
     free (target_helper);
     return retval;
 }
-
-static size_t min(size_t a, size_t b)
-{
-    if (a <= b) return a;
-    return b;
-}
-
-char* path_to_lca(const char* source, const char* target)
-{
-    size_t source_folders_count = 0;
-    size_t target_folders_count = 0;
-    char** source_folders = make_path_folders_array(source, &source_folders_count);
-    char** target_folders = make_path_folders_array(target, &target_folders_count);
-
-    size_t i = 0;
-    size_t size = min(source_folders_count, target_folders_count);
-    char* result = malloc ((MAX_PATH_LENGTH + 1) * sizeof (char));
-    CHECK_PTR(result);
-    strcpy(result, "/");
-    while (i < size && (strcmp(source_folders[i], target_folders[i])) == 0) {
-        strcat(result, source_folders[i]);
-        strcat(result, "/");
-        i++;
-    }
-
-    free_array_of_strings(source_folders, source_folders_count);
-    free_array_of_strings(target_folders, target_folders_count);
-    return result;
-}
@@ -1,9 +1,10 @@
+#pragma once
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
-#include "HashMap.h"
-
-// Max length of path (excluding terminating null character).
-#define MAX_PATH_LENGTH 4095
+#include "StripedMap.h"
+#include "Tree.h" // MAX_PATH_LENGTH
 
 // Max length of folder name (excluding terminating null character).
 #define MAX_FOLDER_NAME_LENGTH 255
@@ -14,55 +15,42 @@
 // sequences of 'a'-'z' ASCII characters, of length from 1 to MAX_FOLDER_NAME_LENGTH.
 bool is_path_valid(const char* path);
 
-// Return the subpath obtained by removing the first component.
-// Args:
-// - `path`: should be a valid path (see `is_path_valid`).
-// - `component`: if not NULL, should be a buffer of size at least MAX_FOLDER_NAME_LENGTH + 1.
-//    Then the first component will be copied there (without any '/' characters).
-// If path is "/", returns NULL and leaves `component` unchanged.
-// Otherwise, the returns a pointer into `path`, representing a valid subpath.
-//
-// This can be used to iterate over all components of a path:
-//     char component[MAX_FOLDER_NAME_LENGTH + 1];
-//     const char* subpath = path;
-//     while (subpath = split_path(subpath, component))
-//         printf("%s", component);
-const char* split_path(const char* path, char* component);
-
-// Return a copy of the subpath obtained by removing the last component.
-// The caller should free the result, unless it is NULL.
-// Args:
-// - `path`: should be a valid path (see `is_path_valid`).
-// - `component`: if not NULL, should be a buffer of size at least MAX_FOLDER_NAME_LENGTH + 1.
-//    Then the last component will be copied there (without any '/' characters).
-// If path is "/", returns NULL and leaves `component` unchanged.
-// Otherwise, the result is a valid path.
-char* make_path_to_parent(const char* path, char* component);
-
-// Return an array containing all keys, lexicographically sorted.
-// The result is null-terminated.
-// Keys are not copied, they are only valid as long as the map.
-// The caller should free the result.
-const char** make_map_contents_array(HashMap* map);
-
-// Return a string containing all keys in map, sorted, comma-separated.
-// The result has no trailing comma. An empty map yields an empty string.
-// The caller should free the result.
-char* make_map_contents_string(HashMap* map);
-
-// Return an array containing all folders in the path.
-// Function does not modify the path itself.
-// Saves size of result array into variable size.
-// The caller should free the result.
-char** make_path_folders_array(const char* path, size_t *size);
-
-// Free array of strings and its contents.
-void free_array_of_strings(char** arr, size_t size);
+// Positions of all '/' characters of a valid path.
+// Component i spans from slash[i] + 1 to slash[i + 1] - 1, there are
+// count components, so "/" has none and "/a/b/" has two.
+typedef struct PathComponents {
+    size_t count;
+    uint16_t slash[MAX_PATH_LENGTH / 2 + 2];
+} PathComponents;
+
+// Check the path like is_path_valid and, if it is valid and `components`
+// is not NULL, fill it with positions of the components.
+// On x86 the path is scanned once with SSE2 or AVX2, chosen by what the CPU
+// supports, other platforms use a scalar loop.
+bool parse_path(const char* path, PathComponents* components);
+
+// Copy component `i` of the path parsed into `components` to `component`,
+// which should be a buffer of size at least MAX_FOLDER_NAME_LENGTH + 1.
+void path_component(const char* path, const PathComponents* components, size_t i,
+                    char* component);
+
+// Return the number of leading components two parsed paths have in common.
+size_t common_components(const char* path1, const PathComponents* components1,
+                         const char* path2, const PathComponents* components2);
+
+// Return a string containing at most `limit` keys of the map that are greater
+// than `after` (or the first keys, if `after` is NULL), sorted, comma-separated.
+// The result has no trailing comma. No matching keys yield an empty string.
+// The caller should hold all stripes of the map and free the result.
+char* make_list_range_string(StripedMap* map, const char* after, size_t limit);
+
+// Write the same string as make_list_range_string into `buffer` of size
+// `capacity` and return its size including the terminating null character.
+// If that is more than `capacity`, `buffer` is left as an empty string
+// (when capacity is not 0). Nothing is allocated.
+size_t write_list_range(StripedMap* map, const char* after, size_t limit,
+                        char* buffer, size_t capacity);
 
 // Function checks if source is a prefix of target.
 // Returns false if paths are equal.
 bool moving_to_subtree(const char* source, const char* target);
-
-// Return string containing a path to last common ancestor of source and target.
-// We assume that both paths are valid.
-char* path_to_lca(const char* source, const char* target);
\ No newline at end of file
@@ -3,11 +3,19 @@
 #include <stdlib.h>
 #include <string.h>
 
-// Initialize rw.
-void rw_init(struct readwrite* rw) {
-    CHECK(pthread_mutex_init(&rw->lock, 0));
-    CHECK(pthread_cond_init(&rw->readers, 0));
-    CHECK(pthread_cond_init(&rw->writers, 0));
+// Initialize rw, with pthread objects shared between processes if pshared.
+static void rw_init_attr(struct readwrite* rw, int pshared) {
+    pthread_mutexattr_t mutex_attr;
+    pthread_condattr_t cond_attr;
+    CHECK(pthread_mutexattr_init(&mutex_attr));
+    CHECK(pthread_mutexattr_setpshared(&mutex_attr, pshared));
+    CHECK(pthread_condattr_init(&cond_attr));
+    CHECK(pthread_condattr_setpshared(&cond_attr, pshared));
+    CHECK(pthread_mutex_init(&rw->lock, &mutex_attr));
+    CHECK(pthread_cond_init(&rw->readers, &cond_attr));
+    CHECK(pthread_cond_init(&rw->writers, &cond_attr));
+    CHECK(pthread_condattr_destroy(&cond_attr));
+    CHECK(pthread_mutexattr_destroy(&mutex_attr));
 
     rw->rcount = 0;
     rw->wcount = 0;
@@ -16,6 +24,15 @@ void rw_init(struct readwrite* rw) {
     rw->change = false;
 }
 
+// Initialize rw.
+void rw_init(struct readwrite* rw) {
+    rw_init_attr(rw, PTHREAD_PROCESS_PRIVATE);
+}
+
+void rw_init_shared(struct readwrite* rw) {
+    rw_init_attr(rw, PTHREAD_PROCESS_SHARED);
+}
+
 // Destroy rw elements from pthread.
 void rw_destroy(struct readwrite* rw) {
     CHECK(pthread_mutex_destroy(&rw->lock));
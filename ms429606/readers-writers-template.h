@@ -13,6 +13,10 @@ struct readwrite {
 
 void rw_init(struct readwrite* rw);
 
+// Initialize rw placed in memory shared between processes,
+// so that threads of all of them can use it.
+void rw_init_shared(struct readwrite* rw);
+
 void rw_destroy(struct readwrite* rw);
 
 void rw_reader_preliminary_protocol(struct readwrite* rw);
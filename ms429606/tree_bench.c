@@ -0,0 +1,288 @@
+/* Author Mikołaj Szkaradek */
+// Measures lookups in a deep, sparse namespace: many independent chains
+// of folders, each one the only subfolder of the previous, like
+// /org/team/project/env/region/. Every thread lists and stats the deepest
+// folders of random chains, or subfolders of them that do not exist.
+// With -b the namespace is a full tree instead, every folder above the
+// deepest level has the same number of subfolders, and lookups go to
+// random leaves.
+// With -w the threads instead create and remove folders of one hot folder,
+// where every remove and most creates need the writer of that folder.
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "Trace.h"
+#include "Tree.h"
+#include "err.h"
+#include "path_utils.h"
+
+typedef struct Bench {
+    Tree* tree;
+    TreeImage* image; // If set, lookups go to the frozen image instead.
+    int chains;
+    int fanout; // If not 0, the tree is full and `chains` is unused.
+    long leaves; // Folders at the deepest level of a full tree.
+    int depth;
+    long ops;
+    int misses;
+    unsigned int seed;
+    pthread_barrier_t* barrier;
+    bool hot; // Create and remove in HOT_FOLDER instead of lookups.
+    int thread;
+} Bench;
+
+#define HOT_FOLDER "/hot/"
+
+// Number of its own folders each thread keeps in HOT_FOLDER at most.
+#define HOT_NAMES 4
+
+static void usage(const char* program)
+{
+    fprintf(stderr,
+        "Usage: %s [-t threads] [-n chains | -b fanout] [-d depth] [-o operations] [-m misses]\n"
+        "       [-f] [-i] [-w] [-c]\n"
+        "  -t threads     number of threads doing lookups (default 4)\n"
+        "  -n chains      number of chains below the root (default 1000)\n"
+        "  -b fanout      build a full tree with this many subfolders of every folder\n"
+        "                 instead of chains\n"
+        "  -d depth       number of folders in each chain, or levels of the full tree\n"
+        "                 (default 16)\n"
+        "  -o operations  lookups done by each thread (default 200000)\n"
+        "  -m misses      percent of lookups of folders that do not exist (default 0)\n"
+        "  -f             keep Bloom filters (tree_set_filters)\n"
+        "  -i             look up in a frozen image of the tree (tree_freeze)\n"
+        "  -w             create and remove folders of one hot folder instead\n"
+        "  -c             combine creates and removes (tree_set_combining)\n",
+        program);
+    exit(1);
+}
+
+// Write to `path` the path of the folder at `level` (counting from 1) of
+// chain `chain`. Folder names can only have letters, so numbers are
+// written in base 26.
+static void chain_path(char* path, int chain, int level)
+{
+    size_t len = 0;
+    path[len++] = '/';
+    for (int i = 0; i < level; ++i) {
+        path[len++] = 'a' + i % 26;
+        int n = i == 0 ? chain : i;
+        do {
+            path[len++] = 'a' + n % 26;
+            n /= 26;
+        } while (n);
+        path[len++] = '/';
+    }
+    path[len] = '\0';
+}
+
+// Write to `path` the path of folder `leaf` (counting from 0) at `level`
+// of the full tree with `fanout` subfolders of every folder. Digits of
+// `leaf` in base `fanout` choose the subfolder on each level, they are
+// named like in chain_path.
+static void full_tree_path(char* path, int fanout, int level, long leaf)
+{
+    long divisor = 1;
+    for (int i = 1; i < level; ++i)
+        divisor *= fanout;
+    size_t len = 0;
+    path[len++] = '/';
+    for (int i = 0; i < level; ++i) {
+        path[len++] = 'a' + i % 26;
+        long n = leaf / divisor % fanout;
+        do {
+            path[len++] = 'a' + n % 26;
+            n /= 26;
+        } while (n);
+        path[len++] = '/';
+        divisor /= fanout;
+    }
+    path[len] = '\0';
+}
+
+// Create and remove folders of HOT_FOLDER named by the thread and
+// a letter, so every result is known. Each create of a folder is followed
+// by its remove HOT_NAMES operations later.
+static void hot_ops(Bench* bench)
+{
+    char path[MAX_PATH_LENGTH + 1];
+    for (long i = 0; i < bench->ops; ++i) {
+        long round = i / HOT_NAMES;
+        int letter = i % HOT_NAMES;
+        int n = bench->thread;
+        size_t len = strlen(HOT_FOLDER);
+        memcpy(path, HOT_FOLDER, len);
+        do {
+            path[len++] = 'a' + n % 26;
+            n /= 26;
+        } while (n);
+        path[len++] = 'a' + letter;
+        path[len++] = '/';
+        path[len] = '\0';
+        int result = round % 2 ? tree_remove(bench->tree, path) : tree_create(bench->tree, path);
+        if (result != 0)
+            fatal("Wrong result for %s", path);
+    }
+}
+
+static void* bench_thread(void* data)
+{
+    Bench* bench = data;
+    char path[MAX_PATH_LENGTH + 1];
+    TreeStat stat;
+    pthread_barrier_wait(bench->barrier);
+    if (bench->hot) {
+        hot_ops(bench);
+        return NULL;
+    }
+    for (long i = 0; i < bench->ops; ++i) {
+        if (bench->fanout)
+            full_tree_path(path, bench->fanout, bench->depth, rand_r(&bench->seed) % bench->leaves);
+        else
+            chain_path(path, rand_r(&bench->seed) % bench->chains, bench->depth);
+        bool miss = rand_r(&bench->seed) % 100 < bench->misses;
+        if (miss)
+            strcat(path, "missing/");
+        if (bench->image) {
+            bool found = i % 2 ? tree_image_list(bench->image, path) != NULL
+                               : tree_image_stat(bench->image, path, &stat) == 0;
+            if (found == miss)
+                fatal("Wrong result for %s", path);
+        } else if (i % 2) {
+            free(tree_list(bench->tree, path));
+        } else if ((tree_stat(bench->tree, path, &stat) != 0) != miss) {
+            fatal("Wrong result for %s", path);
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char* argv[])
+{
+    int threads = 4, chains = 1000, fanout = 0, depth = 16;
+    long ops = 200000;
+    int misses = 0;
+    bool filters = false, image = false, hot = false, combining = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:n:b:d:o:m:fiwc")) != -1) {
+        switch (opt) {
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'n':
+            chains = atoi(optarg);
+            break;
+        case 'b':
+            fanout = atoi(optarg);
+            break;
+        case 'd':
+            depth = atoi(optarg);
+            break;
+        case 'o':
+            ops = atol(optarg);
+            break;
+        case 'm':
+            misses = atoi(optarg);
+            break;
+        case 'f':
+            filters = true;
+            break;
+        case 'i':
+            image = true;
+            break;
+        case 'w':
+            hot = true;
+            break;
+        case 'c':
+            combining = true;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc || threads <= 0 || chains <= 0 || fanout < 0 || depth <= 0 || ops <= 0
+        || misses < 0 || misses > 100 || depth * 8 + 8 > MAX_PATH_LENGTH)
+        usage(argv[0]);
+    // Leaves of a full tree are picked with rand_r, so there can be
+    // at most RAND_MAX of them.
+    long leaves = 1;
+    for (int level = 0; fanout && level < depth; ++level) {
+        if (leaves > RAND_MAX / fanout)
+            usage(argv[0]);
+        leaves *= fanout;
+    }
+
+    // Folders are created one by one, the way clients build namespaces.
+    Tree* tree = tree_new();
+    tree_set_filters(tree, filters);
+    tree_set_combining(tree, combining);
+    char path[MAX_PATH_LENGTH + 1];
+    uint64_t start = trace_now();
+    size_t folders = 0;
+    if (fanout) {
+        long count = 1;
+        for (int level = 1; level <= depth; ++level) {
+            count *= fanout;
+            for (long leaf = 0; leaf < count; ++leaf) {
+                full_tree_path(path, fanout, level, leaf);
+                CHECK(tree_create(tree, path));
+            }
+            folders += count;
+        }
+    } else {
+        for (int c = 0; c < chains; ++c) {
+            for (int level = 1; level <= depth; ++level) {
+                chain_path(path, c, level);
+                CHECK(tree_create(tree, path));
+            }
+        }
+        folders = (size_t)chains * depth;
+    }
+    if (hot)
+        CHECK(tree_create(tree, HOT_FOLDER));
+    uint64_t build = trace_now() - start;
+    start = trace_now();
+    TreeImage* frozen = image ? tree_freeze(tree) : NULL;
+    uint64_t freeze = trace_now() - start;
+
+    pthread_barrier_t barrier;
+    CHECK(pthread_barrier_init(&barrier, NULL, threads + 1));
+    Bench* benches = calloc(threads, sizeof(Bench));
+    pthread_t* ids = malloc(threads * sizeof(pthread_t));
+    CHECK_PTR(benches);
+    CHECK_PTR(ids);
+    for (int t = 0; t < threads; ++t) {
+        benches[t] = (Bench){ tree, frozen, chains, fanout, leaves, depth, ops, misses, t + 1,
+                              &barrier, hot, t };
+        CHECK(pthread_create(&ids[t], NULL, bench_thread, &benches[t]));
+    }
+    pthread_barrier_wait(&barrier);
+    start = trace_now();
+    for (int t = 0; t < threads; ++t)
+        CHECK(pthread_join(ids[t], NULL));
+    uint64_t elapsed = trace_now() - start;
+
+    if (fanout)
+        printf("fanout %d, ", fanout);
+    else
+        printf("chains %d, ", chains);
+    printf("depth %d, folders %zu, build %.3f s (%.0f creates/s)\n",
+           depth, folders, build / 1e9, folders * 1e9 / build);
+    if (frozen)
+        printf("freeze %.3f s\n", freeze / 1e9);
+    printf("threads %d, %s %ld, time %.3f s, throughput %.0f %s/s%s\n",
+           threads, hot ? "creates and removes" : "lookups", threads * ops, elapsed / 1e9,
+           threads * ops * 1e9 / elapsed, hot ? "operations" : "lookups",
+           combining ? ", combining" : "");
+
+    CHECK(pthread_barrier_destroy(&barrier));
+    free(benches);
+    free(ids);
+    if (frozen)
+        tree_image_free(frozen);
+    tree_free(tree);
+    return 0;
+}
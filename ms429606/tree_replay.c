@@ -0,0 +1,215 @@
+/* Author Mikołaj Szkaradek */
+// Replays a trace recorded with tree_set_recorder against a fresh tree
+// and reports throughput and latency of every kind of operation.
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "Trace.h"
+#include "Tree.h"
+#include "err.h"
+
+typedef struct Replayer {
+    Tree* tree;
+    TraceRecord* records;
+    size_t* ops; // Indices of records replayed by this thread, in order.
+    size_t n_ops;
+    uint64_t* latencies; // Latency of every record, indexed like records.
+    uint64_t first_start; // Recorded start of the first operation.
+    uint64_t replay_start; // Time the replay started, shared by all threads.
+    double speed;
+    pthread_barrier_t* barrier;
+    atomic_size_t* mismatches;
+} Replayer;
+
+static void usage(const char* program)
+{
+    fprintf(stderr,
+        "Usage: %s [-t threads] [-s speed] trace_file\n"
+        "  -t threads  replay with this many threads, dealing operations round-robin\n"
+        "              in start order (default: one thread per recorded thread)\n"
+        "  -s speed    1 keeps the recorded pace and interleaving (default),\n"
+        "              2 replays twice as fast, 0 as fast as possible\n",
+        program);
+    exit(1);
+}
+
+// Perform one recorded operation and return its result, encoded as in the trace.
+static int replay_one(Tree* tree, const TraceRecord* r)
+{
+    char* list;
+    switch (r->op) {
+    case TRACE_OP_SETUP:
+    case TRACE_OP_CREATE:
+        return tree_create(tree, r->path);
+    case TRACE_OP_CREATE_ALL:
+        return tree_create_all(tree, r->path);
+    case TRACE_OP_REMOVE:
+        return tree_remove(tree, r->path);
+    case TRACE_OP_MOVE:
+        return tree_move(tree, r->path, r->target);
+    case TRACE_OP_COPY:
+        return tree_copy(tree, r->path, r->target);
+    case TRACE_OP_LIST:
+        list = tree_list(tree, r->path);
+        break;
+    case TRACE_OP_LIST_RANGE:
+        list = tree_list_range(tree, r->path, r->target, r->limit);
+        break;
+    default:
+        return -1;
+    }
+    free(list);
+    return list ? 0 : -1;
+}
+
+static void sleep_until(uint64_t deadline)
+{
+    struct timespec ts = { deadline / 1000000000u, deadline % 1000000000u };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+static void* replay_thread(void* data)
+{
+    Replayer* replayer = data;
+    pthread_barrier_wait(replayer->barrier);
+    for (size_t i = 0; i < replayer->n_ops; ++i) {
+        const TraceRecord* r = &replayer->records[replayer->ops[i]];
+        if (replayer->speed > 0)
+            sleep_until(replayer->replay_start
+                        + (uint64_t)((r->start - replayer->first_start) / replayer->speed));
+        uint64_t start = trace_now();
+        int result = replay_one(replayer->tree, r);
+        replayer->latencies[replayer->ops[i]] = trace_now() - start;
+        if (result != r->result)
+            atomic_fetch_add(replayer->mismatches, 1);
+    }
+    return NULL;
+}
+
+static int compare_u64(const void* p1, const void* p2)
+{
+    uint64_t a = *(const uint64_t*)p1, b = *(const uint64_t*)p2;
+    return (a > b) - (a < b);
+}
+
+// Print count and latency percentiles of operations of one kind.
+static void report_op(TraceOp op, const TraceRecord* records, const uint64_t* latencies,
+                      size_t first, size_t n)
+{
+    uint64_t* sample = malloc((n + 1) * sizeof(uint64_t));
+    CHECK_PTR(sample);
+    size_t count = 0;
+    for (size_t i = first; i < n; ++i)
+        if (records[i].op == op)
+            sample[count++] = latencies[i];
+    if (count) {
+        qsort(sample, count, sizeof(uint64_t), compare_u64);
+        printf("%-10s %10zu %10.2f %10.2f %10.2f\n", trace_op_name(op), count,
+               sample[count / 2] / 1e3, sample[count * 99 / 100] / 1e3,
+               sample[count - 1] / 1e3);
+    }
+    free(sample);
+}
+
+int main(int argc, char* argv[])
+{
+    int threads = 0;
+    double speed = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:s:")) != -1) {
+        switch (opt) {
+        case 't':
+            threads = atoi(optarg);
+            if (threads <= 0)
+                usage(argv[0]);
+            break;
+        case 's':
+            speed = atof(optarg);
+            if (speed < 0)
+                usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1)
+        usage(argv[0]);
+
+    size_t n;
+    TraceRecord* records = trace_read_all(argv[optind], &n);
+    if (!records)
+        syserr("Cannot read trace %s", argv[optind]);
+
+    // Setup records come first, they rebuild the initial tree untimed.
+    Tree* tree = tree_new();
+    size_t first = 0;
+    while (first < n && records[first].op == TRACE_OP_SETUP)
+        replay_one(tree, &records[first++]);
+
+    bool keep_threads = threads == 0;
+    for (size_t i = first; keep_threads && i < n; ++i)
+        if ((int)records[i].thread >= threads)
+            threads = records[i].thread + 1;
+    if (threads == 0)
+        threads = 1;
+
+    Replayer* replayers = calloc(threads, sizeof(Replayer));
+    CHECK_PTR(replayers);
+    uint64_t* latencies = calloc(n + 1, sizeof(uint64_t));
+    CHECK_PTR(latencies);
+    for (int t = 0; t < threads; ++t) {
+        replayers[t].ops = malloc((n - first + 1) * sizeof(size_t));
+        CHECK_PTR(replayers[t].ops);
+    }
+    for (size_t i = first; i < n; ++i) {
+        int t = keep_threads ? (int)records[i].thread : (int)((i - first) % threads);
+        replayers[t].ops[replayers[t].n_ops++] = i;
+    }
+
+    pthread_barrier_t barrier;
+    atomic_size_t mismatches = 0;
+    CHECK(pthread_barrier_init(&barrier, NULL, threads + 1));
+    pthread_t* ids = malloc(threads * sizeof(pthread_t));
+    CHECK_PTR(ids);
+    uint64_t replay_start = trace_now() + 1000000; // Give threads 1 ms to start.
+    for (int t = 0; t < threads; ++t) {
+        replayers[t].tree = tree;
+        replayers[t].records = records;
+        replayers[t].latencies = latencies;
+        replayers[t].first_start = first < n ? records[first].start : 0;
+        replayers[t].replay_start = replay_start;
+        replayers[t].speed = speed;
+        replayers[t].barrier = &barrier;
+        replayers[t].mismatches = &mismatches;
+        CHECK(pthread_create(&ids[t], NULL, replay_thread, &replayers[t]));
+    }
+    pthread_barrier_wait(&barrier);
+    uint64_t start = trace_now();
+    for (int t = 0; t < threads; ++t)
+        CHECK(pthread_join(ids[t], NULL));
+    uint64_t elapsed = trace_now() - start;
+
+    size_t total = n - first;
+    printf("threads %d, operations %zu, time %.3f s, throughput %.0f ops/s\n",
+           threads, total, elapsed / 1e9, elapsed ? total * 1e9 / elapsed : 0.0);
+    printf("results different than recorded: %zu\n", (size_t)mismatches);
+    printf("%-10s %10s %10s %10s %10s\n", "op", "count", "p50 us", "p99 us", "max us");
+    for (TraceOp op = TRACE_OP_LIST; op < TRACE_OP_COUNT; ++op)
+        report_op(op, records, latencies, first, n);
+
+    for (int t = 0; t < threads; ++t)
+        free(replayers[t].ops);
+    free(replayers);
+    free(ids);
+    free(latencies);
+    CHECK(pthread_barrier_destroy(&barrier));
+    tree_free(tree);
+    trace_records_free(records, n);
+    return 0;
+}